@@ -0,0 +1,379 @@
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static char *base;
+static size_t granules;
+static size_t words;
+static uint64_t *alloc_bits;    // 1 for every allocated granule, padding past the pool is set
+static uint64_t *start_bits;    // 1 for the first granule of every allocated block
+
+/****** Word skipping ******
+ * Both return the index of the first word at or after from that differs from skip, or count.
+ * Long runs of full (or empty) words are the common case in a busy small-object pool, so the
+ * AVX2 version compares four words per instruction.
+ */
+
+static size_t skip_words_scalar(const uint64_t *bits, size_t from, size_t count, uint64_t skip)
+{
+    while (from < count && bits[from] == skip)
+        from++;
+
+    return from;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static size_t skip_words_avx2(const uint64_t *bits, size_t from, size_t count, uint64_t skip)
+{
+    __m256i pattern = _mm256_set1_epi64x((long long) skip);
+
+    for (; from + 4 <= count; from += 4)
+    {
+        __m256i same = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) (bits + from)), pattern);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(same));
+        if (mask != 0xf)
+            return from + __builtin_ctz(~mask);
+    }
+
+    return skip_words_scalar(bits, from, count, skip);
+}
+#endif
+
+static size_t (*skip_words)(const uint64_t *, size_t, size_t, uint64_t) = skip_words_scalar;
+
+/* First clear bit at or after from, or limit when there is none before it */
+static size_t next_clear(const uint64_t *bits, size_t from, size_t limit)
+{
+    if (from >= limit)
+        return limit;
+
+    size_t w = from / 64;
+    uint64_t word = ~bits[w] & (~0ull << (from % 64));
+    if (!word)
+    {
+        w = skip_words(bits, w + 1, words, ~0ull);
+        if (w == words)
+            return limit;
+        word = ~bits[w];
+    }
+
+    size_t found = w * 64 + __builtin_ctzll(word);
+    return found < limit ? found : limit;
+}
+
+/* First set bit at or after from, or limit when there is none before it */
+static size_t next_set(const uint64_t *bits, size_t from, size_t limit)
+{
+    if (from >= limit)
+        return limit;
+
+    size_t w = from / 64;
+    uint64_t word = bits[w] & (~0ull << (from % 64));
+    if (!word)
+    {
+        w = skip_words(bits, w + 1, words, 0);
+        if (w == words)
+            return limit;
+        word = bits[w];
+    }
+
+    size_t found = w * 64 + __builtin_ctzll(word);
+    return found < limit ? found : limit;
+}
+
+/* Set or clear the bits [from, to) */
+static void set_range(uint64_t *bits, size_t from, size_t to, bool value)
+{
+    while (from < to)
+    {
+        size_t w = from / 64;
+        size_t end = (w + 1) * 64 < to ? (w + 1) * 64 : to;
+        uint64_t mask = (end - from == 64 ? ~0ull : ((1ull << (end - from)) - 1)) << (from % 64);
+
+        if (value)
+            bits[w] |= mask;
+        else
+            bits[w] &= ~mask;
+        from = end;
+    }
+}
+
+/* Last set bit at or before from, or SIZE_MAX when there is none */
+static size_t prev_set(const uint64_t *bits, size_t from)
+{
+    size_t w = from / 64;
+    uint64_t word = bits[w] & (~0ull >> (63 - from % 64));
+
+    while (!word)
+    {
+        if (!w--)
+            return SIZE_MAX;
+        word = bits[w];
+    }
+
+    return w * 64 + 63 - __builtin_clzll(word);
+}
+
+/* Length in granules of the allocated block starting at granule */
+static size_t block_length(size_t granule)
+{
+    size_t next_start = next_set(start_bits, granule + 1, granules);
+    size_t next_free = next_clear(alloc_bits, granule, granules);
+    return (next_start < next_free ? next_start : next_free) - granule;
+}
+
+/**
+ * Takes over a pool for the Bitmap strategy, dropping any previous one
+ * @param pool start of the pool
+ * @param size bytes in the pool
+ * @return bytes usable, the pool rounded down to whole granules
+ */
+size_t bitmap_init(void *pool, size_t size)
+{
+    bitmap_release();
+
+    base = pool;
+    granules = size / BITMAP_GRANULE;
+    words = (granules + 63) / 64;
+    alloc_bits = calloc(words ? words : 1, sizeof(uint64_t));
+    start_bits = calloc(words ? words : 1, sizeof(uint64_t));
+    set_range(alloc_bits, granules, words * 64, true);
+
+#ifdef HAVE_X86_SIMD
+    skip_words = __builtin_cpu_supports("avx2") ? skip_words_avx2 : skip_words_scalar;
+#endif
+
+    return granules * BITMAP_GRANULE;
+}
+
+void bitmap_release(void)
+{
+    free(alloc_bits);
+    free(start_bits);
+    alloc_bits = start_bits = NULL;
+    granules = words = 0;
+}
+
+/**
+ * First-fit search for a run of clear bits: jump to the next clear bit, measure the run up to
+ * the next set bit, and carry on after it when the run is too short
+ * @param requested bytes needed, rounded up to whole granules
+ * @return start of the block, NULL if no run is long enough
+ */
+void *bitmap_malloc(size_t requested)
+{
+    // Rounding a request near SIZE_MAX up to granules would wrap to 0
+    if (requested > granules * BITMAP_GRANULE)
+        return NULL;
+
+    size_t need = requested ? (requested + BITMAP_GRANULE - 1) / BITMAP_GRANULE : 1;
+    size_t position = 0;
+
+    while ((position = next_clear(alloc_bits, position, granules)) < granules)
+    {
+        size_t limit = position + need < granules ? position + need : granules;
+        size_t end = next_set(alloc_bits, position, limit);
+        if (end - position == need)
+        {
+            set_range(alloc_bits, position, end, true);
+            set_range(start_bits, position, position + 1, true);
+            return base + position * BITMAP_GRANULE;
+        }
+        position = end;
+    }
+
+    return NULL;
+}
+
+static bool bit_set(const uint64_t *bits, size_t granule)
+{
+    return bits[granule / 64] >> (granule % 64) & 1;
+}
+
+/**
+ * @param ptr start of a block returned by bitmap_malloc
+ * @param size the size it was allocated with, 0 if unknown
+ * @return false if ptr is not the start of an allocated block, or size does not end at a block
+ * boundary
+ */
+bool bitmap_free(void *ptr, size_t size)
+{
+    if (!bitmap_is_alloc(ptr))
+        return false;
+
+    // A known size saves the scans for the next block start and the next clear granule
+    size_t granule = ((char *) ptr - base) / BITMAP_GRANULE;
+    size_t length = size ? (size + BITMAP_GRANULE - 1) / BITMAP_GRANULE : block_length(granule);
+
+    // Whatever follows a block is free, another block or the end of the pool. Anything else
+    // means the size is wrong, and clearing that far would free part of the next block
+    size_t end = granule + length;
+    if (size && (length > granules - granule ||
+                 (end < granules && bit_set(alloc_bits, end) && !bit_set(start_bits, end))))
+        return false;
+    assert(length == block_length(granule));
+    set_range(alloc_bits, granule, granule + length, false);
+    set_range(start_bits, granule, granule + 1, false);
+    return true;
+}
+
+size_t bitmap_allocated(void)
+{
+    size_t set = 0;
+    for (size_t w = 0; w < words; w++)
+        set += __builtin_popcountll(alloc_bits[w]);
+
+    return (set - (words * 64 - granules)) * BITMAP_GRANULE;
+}
+
+/* A hole starts at every clear bit whose lower neighbour is set, or at granule 0 */
+size_t bitmap_holes(void)
+{
+    size_t holes = 0;
+    uint64_t carry = 1;
+
+    for (size_t w = 0; w < words; w++)
+    {
+        holes += __builtin_popcountll(~alloc_bits[w] & (alloc_bits[w] << 1 | carry));
+        carry = alloc_bits[w] >> 63;
+    }
+
+    return holes;
+}
+
+size_t bitmap_largest_free(void)
+{
+    size_t largest = 0, position = 0;
+
+    while ((position = next_clear(alloc_bits, position, granules)) < granules)
+    {
+        size_t end = next_set(alloc_bits, position, granules);
+        if (end - position > largest)
+            largest = end - position;
+        position = end;
+    }
+
+    return largest * BITMAP_GRANULE;
+}
+
+size_t bitmap_small_free(size_t size)
+{
+    size_t count = 0, position = 0;
+
+    while ((position = next_clear(alloc_bits, position, granules)) < granules)
+    {
+        size_t end = next_set(alloc_bits, position, granules);
+        if ((end - position) * BITMAP_GRANULE <= size)
+            count++;
+        position = end;
+    }
+
+    return count;
+}
+
+bool bitmap_is_alloc(void *ptr)
+{
+    size_t offset = (char *) ptr - base;
+
+    if ((char *) ptr < base || offset % BITMAP_GRANULE || offset / BITMAP_GRANULE >= granules)
+        return false;
+
+    size_t granule = offset / BITMAP_GRANULE;
+    return start_bits[granule / 64] >> (granule % 64) & 1;
+}
+
+/* Bytes in the block at ptr, whole granules, 0 if ptr does not start an allocated block */
+size_t bitmap_usable_size(void *ptr)
+{
+    if (!bitmap_is_alloc(ptr))
+        return 0;
+
+    return block_length(((char *) ptr - base) / BITMAP_GRANULE) * BITMAP_GRANULE;
+}
+
+/**
+ * Describes the block starting at a given offset, for walking the pool in address order
+ * @param offset byte offset of a block start, 0 for the first block
+ * @param size set to the block size in bytes
+ * @param alloc set to whether the block is allocated
+ * @return false once offset is past the last block
+ */
+bool bitmap_block_at(size_t offset, size_t *size, bool *alloc)
+{
+    size_t granule = offset / BITMAP_GRANULE;
+    if (granule >= granules)
+        return false;
+
+    *alloc = alloc_bits[granule / 64] >> (granule % 64) & 1;
+    if (*alloc)
+        *size = block_length(granule) * BITMAP_GRANULE;
+    else
+        *size = (next_set(alloc_bits, granule, granules) - granule) * BITMAP_GRANULE;
+    return true;
+}
+
+/**
+ * Finds the block a byte offset falls in: back to the block's start bit when the granule is
+ * allocated, back to the end of the previous block when it is not
+ * @param offset byte offset inside the pool
+ * @param start set to the byte offset the block starts at
+ * @param size set to the block size in bytes
+ * @param alloc set to whether the block is allocated
+ */
+void bitmap_block_of(size_t offset, size_t *start, size_t *size, bool *alloc)
+{
+    size_t granule = offset / BITMAP_GRANULE;
+    size_t first;
+
+    if (alloc_bits[granule / 64] >> (granule % 64) & 1)
+        first = prev_set(start_bits, granule);
+    else
+        first = prev_set(alloc_bits, granule) + 1;     // SIZE_MAX wraps to the pool start
+
+    *start = first * BITMAP_GRANULE;
+    bitmap_block_at(*start, size, alloc);
+}
+
+/* Fill the mem_stats fields that describe the heap itself */
+void bitmap_stats(mem_stats_t *out)
+{
+    size_t offset = 0, size;
+    bool alloc;
+
+    out->allocated_bytes = bitmap_allocated();
+    out->holes = out->blocks = out->largest_free = 0;
+    memset(out->hole_histogram, 0, sizeof(out->hole_histogram));
+
+    for (; bitmap_block_at(offset, &size, &alloc); offset += size)
+    {
+        out->blocks++;
+        if (alloc)
+            continue;
+
+        int bucket = 63 - __builtin_clzll(size);
+        out->hole_histogram[bucket < MEM_HOLE_BUCKETS ? bucket : MEM_HOLE_BUCKETS - 1]++;
+        out->holes++;
+        if (size > out->largest_free)
+            out->largest_free = size;
+    }
+}
+
+/**
+ * Checks every block start lies on an allocated granule and the padding past the pool is set
+ * @return 0 when consistent, -1 otherwise
+ */
+int bitmap_check(void)
+{
+    for (size_t w = 0; w < words; w++)
+        if (start_bits[w] & ~alloc_bits[w])
+            return -1;
+
+    if (words && next_clear(alloc_bits, granules, words * 64) != words * 64)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+#include "mymem.h"
+
+/*
+ * Bit array engine behind the Bitmap strategy. The pool is cut into BITMAP_GRANULE byte
+ * granules with one bit each in the allocation map, and a second map marks the granule every
+ * block starts at, which is all myfree needs to recover a block's length. Searches, hole counts
+ * and allocated bytes are word-level tzcnt/popcnt operations instead of node walks.
+ */
+#define BITMAP_GRANULE 16
+
+size_t bitmap_init(void *, size_t);
+void bitmap_release(void);
+void *bitmap_malloc(size_t);
+bool bitmap_free(void *, size_t);
+size_t bitmap_allocated(void);
+size_t bitmap_holes(void);
+size_t bitmap_largest_free(void);
+size_t bitmap_small_free(size_t);
+bool bitmap_is_alloc(void *);
+size_t bitmap_usable_size(void *);
+bool bitmap_block_at(size_t, size_t *, bool *);
+void bitmap_block_of(size_t, size_t *, size_t *, bool *);
+void bitmap_stats(mem_stats_t *);
+int bitmap_check(void);
+
+#endif
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocktable.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/****** Scans ******
+ * Each scan looks at count consecutive avail slots. first_fit returns the index of the first
+ * slot holding at least requested bytes, or count when there is none. Hole sizes stay far
+ * below 2^63, so the signed 64-bit compares of SSE4.2 and AVX2 are safe.
+ */
+
+static size_t first_fit_scalar(const uint64_t *avail, size_t count, uint64_t requested)
+{
+    for (size_t i = 0; i < count; i++)
+        if (avail[i] >= requested)
+            return i;
+
+    return count;
+}
+
+static uint64_t largest_scalar(const uint64_t *avail, size_t count)
+{
+    uint64_t max = 0;
+    for (size_t i = 0; i < count; i++)
+        if (avail[i] > max)
+            max = avail[i];
+
+    return max;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse4.2")))
+static size_t first_fit_sse42(const uint64_t *avail, size_t count, uint64_t requested)
+{
+    __m128i need = _mm_set1_epi64x((long long) requested - 1);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *) (avail + i)), need);
+        __m128i b = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *) (avail + i + 2)), need);
+        __m128i c = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *) (avail + i + 4)), need);
+        __m128i d = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *) (avail + i + 6)), need);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (!_mm_testz_si128(any, any))
+            break;
+    }
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i hit = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i *) (avail + i)), need);
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(hit));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + first_fit_scalar(avail + i, count - i, requested);
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t largest_sse42(const uint64_t *avail, size_t count)
+{
+    __m128i best = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *) (avail + i));
+        best = _mm_blendv_epi8(best, a, _mm_cmpgt_epi64(a, best));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, best);
+    uint64_t max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    uint64_t tail = largest_scalar(avail + i, count - i);
+    return tail > max ? tail : max;
+}
+
+__attribute__((target("avx2")))
+static size_t first_fit_avx2(const uint64_t *avail, size_t count, uint64_t requested)
+{
+    __m256i need = _mm256_set1_epi64x((long long) requested - 1);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (avail + i)), need);
+        __m256i b = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (avail + i + 4)), need);
+        __m256i c = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (avail + i + 8)), need);
+        __m256i d = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (avail + i + 12)), need);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any))
+            break;
+    }
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i hit = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *) (avail + i)), need);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + first_fit_scalar(avail + i, count - i, requested);
+}
+
+__attribute__((target("avx2")))
+static uint64_t largest_avx2(const uint64_t *avail, size_t count)
+{
+    __m256i best = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (avail + i));
+        best = _mm256_blendv_epi8(best, a, _mm256_cmpgt_epi64(a, best));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, best);
+    uint64_t max = largest_scalar(lanes, 4);
+    uint64_t tail = largest_scalar(avail + i, count - i);
+    return tail > max ? tail : max;
+}
+
+#endif
+
+typedef struct
+{
+    char *name;
+    size_t (*first_fit)(const uint64_t *, size_t, uint64_t);
+    uint64_t (*largest)(const uint64_t *, size_t);
+} scan_impl;
+
+static const scan_impl scans[] = {
+#ifdef HAVE_X86_SIMD
+    {"avx2", first_fit_avx2, largest_avx2},
+    {"sse4.2", first_fit_sse42, largest_sse42},
+#endif
+    {"scalar", first_fit_scalar, largest_scalar},
+};
+
+static const scan_impl *scan;
+
+static bool scan_supported(const scan_impl *impl)
+{
+#ifdef HAVE_X86_SIMD
+    if (impl->first_fit == first_fit_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (impl->first_fit == first_fit_sse42)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return true;
+}
+
+/**
+ * Selects the scan implementation by name, "avx2", "sse4.2" or "scalar". NULL picks the widest
+ * one the CPU supports.
+ * @return 0 on success, -1 if the name is unknown or the CPU lacks the instructions
+ */
+int blocktable_set_scan(char *name)
+{
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scan_impl); i++)
+    {
+        if ((!name || !strcmp(name, scans[i].name)) && scan_supported(&scans[i]))
+        {
+            scan = &scans[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* The scan in use; MEM_TABLE_SCAN in the environment picks one by name on first use */
+static const scan_impl *current_scan(void)
+{
+    if (!scan && blocktable_set_scan(getenv("MEM_TABLE_SCAN")))
+        blocktable_set_scan(NULL);
+
+    return scan;
+}
+
+char *blocktable_scan_name(void)
+{
+    return current_scan()->name;
+}
+
+/****** Gap buffer ******/
+
+static inline size_t block_count(const block_table *table)
+{
+    return table->capacity - (table->gap_end - table->gap_start);
+}
+
+/* Physical slot of the index'th block in address order */
+static inline size_t slot_of(const block_table *table, size_t index)
+{
+    return index < table->gap_start ? index : index + (table->gap_end - table->gap_start);
+}
+
+static void move_slots(block_table *table, size_t to, size_t from, size_t count)
+{
+    memmove(table->offset + to, table->offset + from, count * sizeof(uint64_t));
+    memmove(table->avail + to, table->avail + from, count * sizeof(uint64_t));
+    memmove(table->node + to, table->node + from, count * sizeof(memoryList *));
+}
+
+/* Move the gap so it starts right after the first index blocks */
+static void move_gap(block_table *table, size_t index)
+{
+    if (index < table->gap_start)
+    {
+        size_t count = table->gap_start - index;
+        size_t to = table->gap_end - count;
+        move_slots(table, to, index, count);
+        // Slots that held blocks and now belong to the gap
+        if (index < to)
+            memset(table->avail + index, 0, ((table->gap_start < to ? table->gap_start : to) - index) * sizeof(uint64_t));
+        table->gap_start = index;
+        table->gap_end = to;
+    }
+    else if (index > table->gap_start)
+    {
+        size_t count = index - table->gap_start;
+        size_t from = table->gap_end;
+        move_slots(table, table->gap_start, from, count);
+        size_t clear = from > index ? from : index;
+        memset(table->avail + clear, 0, (from + count - clear) * sizeof(uint64_t));
+        table->gap_start = index;
+        table->gap_end = from + count;
+    }
+}
+
+static void grow(block_table *table)
+{
+    size_t capacity = table->capacity ? table->capacity * 2 : 64;
+    size_t tail = table->capacity - table->gap_end;
+
+    table->offset = realloc(table->offset, capacity * sizeof(uint64_t));
+    table->avail = realloc(table->avail, capacity * sizeof(uint64_t));
+    table->node = realloc(table->node, capacity * sizeof(memoryList *));
+
+    move_slots(table, capacity - tail, table->gap_end, tail);
+    table->gap_end = capacity - tail;
+    memset(table->avail + table->gap_start, 0, (table->gap_end - table->gap_start) * sizeof(uint64_t));
+    table->capacity = capacity;
+}
+
+static void set_slot(block_table *table, size_t slot, memoryList *block)
+{
+    table->offset[slot] = (char *) block->ptr - table->base;
+    table->avail[slot] = block->alloc ? 0 : block->size;
+    table->node[slot] = block;
+}
+
+/* Index of the block starting at offset, or of the first block after it */
+static size_t find_index(const block_table *table, uint64_t offset)
+{
+    size_t low = 0, high = block_count(table);
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (table->offset[slot_of(table, mid)] < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static size_t find_slot(const block_table *table, memoryList *block)
+{
+    size_t slot = slot_of(table, find_index(table, (char *) block->ptr - table->base));
+    assert(table->node[slot] == block);
+    return slot;
+}
+
+/****** Interface used by mymem.c ******/
+
+/**
+ * (Re)builds the table from the memory list, placing the gap after the last block
+ * @param table table to fill, its arrays are reused
+ * @param head first block of the memory list
+ * @param base start of the pool, block offsets are relative to it
+ */
+void blocktable_build(block_table *table, memoryList *head, void *base)
+{
+    size_t count = 0;
+    for (memoryList *current = head; current; current = current->next)
+        count++;
+
+    table->base = base;
+    table->gap_start = 0;
+    table->gap_end = table->capacity;
+    while (table->capacity < count + count / 2 + 1)
+        grow(table);
+
+    for (memoryList *current = head; current; current = current->next)
+        set_slot(table, table->gap_start++, current);
+    memset(table->avail + table->gap_start, 0, (table->capacity - table->gap_start) * sizeof(uint64_t));
+    table->gap_end = table->capacity;
+}
+
+void blocktable_free(block_table *table)
+{
+    free(table->offset);
+    free(table->avail);
+    free(table->node);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Records a split: allocated was carved from the front of hole, which now starts after it
+ * @param allocated new node, its slot goes in front of the hole's
+ * @param hole the block that was split, already updated
+ */
+void blocktable_split(block_table *table, memoryList *allocated, memoryList *hole)
+{
+    size_t index = find_index(table, (char *) allocated->ptr - table->base);
+
+    if (table->gap_start == table->gap_end)
+        grow(table);
+    move_gap(table, index);
+    set_slot(table, table->gap_start++, allocated);
+    set_slot(table, slot_of(table, index + 1), hole);
+}
+
+/* Add the slot of a block that was split off the end of its left neighbour */
+void blocktable_insert(block_table *table, memoryList *block)
+{
+    size_t index = find_index(table, (char *) block->ptr - table->base);
+
+    if (table->gap_start == table->gap_end)
+        grow(table);
+    move_gap(table, index);
+    set_slot(table, table->gap_start++, block);
+}
+
+/* Refresh the slot of a block whose size or allocation changed in place */
+void blocktable_update(block_table *table, memoryList *block)
+{
+    set_slot(table, find_slot(table, block), block);
+}
+
+/* Drop the slot of a block that is about to be merged into its left neighbour */
+void blocktable_remove(block_table *table, memoryList *block)
+{
+    size_t index = find_index(table, (char *) block->ptr - table->base);
+
+    assert(table->node[slot_of(table, index)] == block);
+    move_gap(table, index + 1);
+    table->avail[--table->gap_start] = 0;
+}
+
+/* The block that offset, which must lie inside the pool, falls in */
+memoryList *blocktable_containing(block_table *table, uint64_t offset)
+{
+    size_t index = find_index(table, offset);
+
+    if (index == block_count(table) || table->offset[slot_of(table, index)] != offset)
+        index--;
+    return table->node[slot_of(table, index)];
+}
+
+/**
+ * First-fit over the table
+ * @param requested bytes needed
+ * @param scanned set to the number of slots looked at
+ * @return the lowest addressed hole of at least requested bytes, NULL if there is none
+ */
+memoryList *blocktable_first_fit(block_table *table, size_t requested, size_t *scanned)
+{
+    const scan_impl *impl = current_scan();
+    uint64_t need = requested ? requested : 1;
+    size_t found = impl->first_fit(table->avail, table->gap_start, need);
+
+    if (found == table->gap_start)
+    {
+        size_t tail = table->capacity - table->gap_end;
+        found = table->gap_end + impl->first_fit(table->avail + table->gap_end, tail, need);
+        *scanned = table->gap_start + (found - table->gap_end);
+        return found < table->capacity ? table->node[found] : NULL;
+    }
+
+    *scanned = found + 1;
+    return table->node[found];
+}
+
+size_t blocktable_largest_free(block_table *table)
+{
+    const scan_impl *impl = current_scan();
+    uint64_t left = impl->largest(table->avail, table->gap_start);
+    uint64_t right = impl->largest(table->avail + table->gap_end, table->capacity - table->gap_end);
+
+    return left > right ? left : right;
+}
+
+/**
+ * Checks the table mirrors the memory list slot for slot and the gap is clear
+ * @return 0 when consistent, -1 otherwise
+ */
+int blocktable_check(block_table *table, memoryList *head)
+{
+    size_t index = 0;
+
+    for (memoryList *current = head; current; current = current->next, index++)
+    {
+        if (index >= block_count(table))
+            return -1;
+        size_t slot = slot_of(table, index);
+        if (table->node[slot] != current || table->offset[slot] != (uint64_t) ((char *) current->ptr - table->base) ||
+            table->avail[slot] != (current->alloc ? 0 : current->size))
+            return -1;
+    }
+
+    for (size_t slot = table->gap_start; slot < table->gap_end; slot++)
+        if (table->avail[slot])
+            return -1;
+
+    return index == block_count(table) ? 0 : -1;
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCKTABLE_H
+#define BLOCKTABLE_H
+
+#include <stdint.h>
+
+#include "mymem.h"
+
+/*
+ * Structure-of-arrays mirror of the memory list, enabled with mem_set_block_table. Blocks are
+ * kept in address order in three parallel arrays so first-fit and the largest hole become
+ * linear scans over avail instead of pointer chasing through the nodes.
+ *
+ * The arrays are a gap buffer: slots [0, gap_start) and [gap_end, capacity) hold blocks, the
+ * slots in between are unused. Splits and merges happen close to each other in practice, so
+ * moving the gap to the edit point is usually a short memmove. Unused slots keep avail at 0,
+ * which a scan can never mistake for a hole.
+ */
+typedef struct block_table
+{
+    char *base;             // myMemory, offsets are relative to it
+    uint64_t *offset;
+    uint64_t *avail;        // hole size, 0 for allocated blocks and unused slots
+    memoryList **node;
+    size_t capacity;
+    size_t gap_start;
+    size_t gap_end;
+} block_table;
+
+void blocktable_build(block_table *, memoryList *, void *);
+void blocktable_free(block_table *);
+void blocktable_split(block_table *, memoryList *, memoryList *);
+void blocktable_insert(block_table *, memoryList *);
+void blocktable_update(block_table *, memoryList *);
+void blocktable_remove(block_table *, memoryList *);
+memoryList *blocktable_first_fit(block_table *, size_t, size_t *);
+memoryList *blocktable_containing(block_table *, uint64_t);
+size_t blocktable_largest_free(block_table *);
+int blocktable_check(block_table *, memoryList *);
+
+int blocktable_set_scan(char *);
+char *blocktable_scan_name(void);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * cppbench: container-heavy workloads on std::allocator against the mymem.c pool, through
+ * mymem_allocator<T> and through std::pmr containers over mymem_resource.
+ *
+ *   cppbench [strategy] [-n elements] [-r repeats] [-s pool size]
+ *
+ * Every workload returns a checksum, which must match between the allocators, and the pool
+ * must be empty again once the containers are gone.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "mymem_allocator.hpp"
+
+template <class T>
+using std_alloc = std::allocator<T>;
+
+template <class T>
+using pmr_alloc = std::pmr::polymorphic_allocator<T>;
+
+/* Grow a vector element by element, then read it back */
+template <template <class> class A>
+static uint64_t vector_workload(size_t n)
+{
+    std::vector<uint64_t, A<uint64_t>> values;
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+        values.push_back(i * 2654435761u);
+    for (uint64_t value : values)
+        sum += value;
+
+    return sum;
+}
+
+/* Insert n keys, look all of them up and erase every other one, twice */
+template <template <class> class A>
+static uint64_t hash_workload(size_t n)
+{
+    std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                       A<std::pair<const uint64_t, uint64_t>>> table;
+    uint64_t sum = 0;
+
+    for (int round = 0; round < 2; round++)
+    {
+        for (size_t i = 0; i < n; i++)
+            table[i * 7919 + round] = i;
+        for (size_t i = 0; i < n; i++)
+            sum += table.count(i * 7919 + round);
+        for (size_t i = 0; i < n; i += 2)
+            table.erase(i * 7919 + round);
+    }
+
+    return sum + table.size();
+}
+
+/* Ordered map churn with pseudo-random keys, the node-per-element worst case */
+template <template <class> class A>
+static uint64_t tree_workload(size_t n)
+{
+    std::map<uint64_t, uint64_t, std::less<uint64_t>, A<std::pair<const uint64_t, uint64_t>>> tree;
+    uint64_t key = 1, sum = 0;
+
+    for (size_t i = 0; i < 4 * n; i++)
+    {
+        key = key * 6364136223846793005ull + 1442695040888963407ull;
+        uint64_t slot = (key >> 33) % n;
+        auto found = tree.find(slot);
+        if (found != tree.end())
+        {
+            sum += found->second;
+            tree.erase(found);
+        }
+        else
+            tree.emplace(slot, i);
+    }
+
+    return sum + tree.size();
+}
+
+/* Queue-like list traffic, pushing at the back and popping at the front */
+template <template <class> class A>
+static uint64_t list_workload(size_t n)
+{
+    std::list<uint64_t, A<uint64_t>> queue;
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < 4 * n; i++)
+    {
+        queue.push_back(i);
+        if (i % 3 == 2)
+        {
+            sum += queue.front();
+            queue.pop_front();
+        }
+    }
+
+    return sum + queue.size();
+}
+
+struct workload_entry
+{
+    const char *name;
+    uint64_t (*with_std)(size_t);
+    uint64_t (*with_mymem)(size_t);
+    uint64_t (*with_pmr)(size_t);
+};
+
+#define WORKLOAD(name, fn) {name, fn<std_alloc>, fn<mymem_allocator>, fn<pmr_alloc>}
+
+static const workload_entry workloads[] = {
+    WORKLOAD("vector", vector_workload),
+    WORKLOAD("unordered_map", hash_workload),
+    WORKLOAD("map", tree_workload),
+    WORKLOAD("list", list_workload),
+};
+
+/* Run one workload repeats times, returning the mean milliseconds and the last checksum */
+static double run(uint64_t (*workload)(size_t), size_t n, int repeats, uint64_t *checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; i++)
+        *checksum = workload(n);
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 5000, pool_size = 64 << 20;
+    int repeats = 3, lbound = 1, ubound = 4;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            n = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            pool_size = strtoull(argv[++i], NULL, 10);
+        else if (strategyFromString(argv[i]) > 0)
+            lbound = ubound = strategyFromString(argv[i]);
+        else if (strcmp(argv[i], "all"))
+        {
+            fprintf(stderr, "Usage: cppbench [strategy] [-n elements] [-r repeats] [-s pool size]\n");
+            return 1;
+        }
+    }
+    if (n < 1 || repeats < 1)
+        n = repeats = 1;
+
+    printf("Container benchmark: %zu elements, %d repeats, pool size == %zu (mean ms per run)\n", n, repeats, pool_size);
+
+    int failures = 0;
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        printf("\t=== %s ===\n\t%-14s %14s %14s %14s\n", strategy_name((strategies) strategy), "workload",
+               "std::allocator", "mymem", "pmr mymem");
+
+        for (const workload_entry &entry : workloads)
+        {
+            uint64_t expected, with_mymem, with_pmr;
+            double std_ms = run(entry.with_std, n, repeats, &expected);
+
+            initmem((strategies) strategy, pool_size);
+            double mymem_ms = run(entry.with_mymem, n, repeats, &with_mymem);
+            size_t leaked = mem_allocated_bytes();
+
+            initmem((strategies) strategy, pool_size);
+            std::pmr::memory_resource *previous = std::pmr::set_default_resource(mymem_default_resource());
+            double pmr_ms = run(entry.with_pmr, n, repeats, &with_pmr);
+            std::pmr::set_default_resource(previous);
+            leaked += mem_allocated_bytes();
+
+            printf("\t%-14s %14.3f %14.3f %14.3f\n", entry.name, std_ms, mymem_ms, pmr_ms);
+            if (with_mymem != expected || with_pmr != expected || leaked)
+            {
+                printf("\t%-14s checksum or pool mismatch (%zu bytes left allocated)\n", entry.name, leaked);
+                failures++;
+            }
+        }
+    }
+
+    return failures != 0;
+}
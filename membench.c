@@ -0,0 +1,983 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mymem.h"
+#include "membench.h"
+#include "workload.h"
+#include "blocktable.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+bench_options bench_opts;
+
+static int use_tsc = 0;
+static double ns_per_tick = 1.0;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Picks the timestamp source used for per-operation timing. The TSC is only used when the CPU
+ * reports it as invariant, and it is calibrated against CLOCK_MONOTONIC over 20ms.
+ * Setting MEM_BENCH_CLOCK=monotonic in the environment forces the clock_gettime path.
+ */
+void bench_clock_init(void)
+{
+    use_tsc = 0;
+    ns_per_tick = 1.0;
+
+#ifdef HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    char *forced = getenv("MEM_BENCH_CLOCK");
+
+    if (forced && !strcmp(forced, "monotonic"))
+        return;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        return;
+
+    uint64_t start_ns = monotonic_ns();
+    uint64_t start_tick = __rdtsc();
+    while (monotonic_ns() - start_ns < 20000000)
+        ;
+    uint64_t end_ns = monotonic_ns();
+    uint64_t end_tick = __rdtsc();
+
+    ns_per_tick = (double) (end_ns - start_ns) / (double) (end_tick - start_tick);
+    use_tsc = 1;
+#endif
+}
+
+/* Read the current timestamp in the units of the selected clock */
+uint64_t bench_ticks(void)
+{
+#ifdef HAVE_TSC
+    if (use_tsc)
+    {
+        uint64_t t;
+        _mm_lfence();
+        t = __rdtsc();
+        _mm_lfence();
+        return t;
+    }
+#endif
+    return monotonic_ns();
+}
+
+uint64_t bench_ticks_to_ns(uint64_t ticks)
+{
+    return use_tsc ? (uint64_t) (ticks * ns_per_tick) : ticks;
+}
+
+char *bench_clock_name(void)
+{
+    return use_tsc ? "tsc" : "monotonic";
+}
+
+/****** Latency histogram ******/
+
+static int hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+        return (int) value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int magnitude = msb - HIST_SUB_BITS + 1;
+    if (magnitude > HIST_MAGNITUDES)
+        return HIST_BUCKETS - 1;
+
+    return HIST_SUB_COUNT + (magnitude - 1) * HIST_SUB_HALF + (int) ((value >> magnitude) - HIST_SUB_HALF);
+}
+
+/* Largest value that lands in the given bucket */
+static uint64_t hist_highest_equivalent(int index)
+{
+    if (index < HIST_SUB_COUNT)
+        return index;
+
+    int magnitude = (index - HIST_SUB_COUNT) / HIST_SUB_HALF + 1;
+    uint64_t sub = (index - HIST_SUB_COUNT) % HIST_SUB_HALF + HIST_SUB_HALF;
+
+    return ((sub + 1) << magnitude) - 1;
+}
+
+void hist_reset(latency_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void hist_record(latency_hist *hist, uint64_t value_ns)
+{
+    hist->counts[hist_index(value_ns)]++;
+    hist->total_count++;
+    hist->total_ns += value_ns;
+    if (value_ns > hist->max_ns)
+        hist->max_ns = value_ns;
+}
+
+/**
+ * Get the value below which the given fraction of the recorded samples fall
+ * @param hist histogram to query
+ * @param quantile fraction between 0 and 1, e.g. 0.999 for p99.9
+ * @return the latency in nanoseconds, never more than the recorded maximum
+ */
+uint64_t hist_percentile(const latency_hist *hist, double quantile)
+{
+    if (!hist->total_count)
+        return 0;
+
+    uint64_t target = (uint64_t) (quantile * hist->total_count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= target)
+        {
+            uint64_t value = hist_highest_equivalent(i);
+            return value < hist->max_ns ? value : hist->max_ns;
+        }
+    }
+
+    return hist->max_ns;
+}
+
+/****** Reporting ******/
+
+/**
+ * Opens the CSV and JSON outputs requested on the command line. Either may be absent.
+ * @return 0 on success, 1 if one of the files could not be created
+ */
+int bench_report_open(bench_report *report, char *benchmark)
+{
+    memset(report, 0, sizeof(*report));
+    report->benchmark = benchmark;
+
+    if (bench_opts.csv_path)
+    {
+        report->csv = fopen(bench_opts.csv_path, "w");
+        if (!report->csv)
+        {
+            perror("Can't create CSV output");
+            return 1;
+        }
+        fprintf(report->csv, "benchmark,strategy,op,param,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,ops_per_sec\n");
+    }
+
+    if (bench_opts.json_path)
+    {
+        report->json = fopen(bench_opts.json_path, "w");
+        if (!report->json)
+        {
+            perror("Can't create JSON output");
+            return 1;
+        }
+        fprintf(report->json, "[");
+    }
+
+    return 0;
+}
+
+/* Emit one histogram as a result row. param is benchmark specific, e.g. the live block count. */
+void bench_report_hist(bench_report *report, char *strategy, char *op, size_t param, const latency_hist *hist)
+{
+    double mean = hist->total_count ? (double) hist->total_ns / hist->total_count : 0;
+    double ops_per_sec = hist->total_ns ? hist->total_count * 1e9 / hist->total_ns : 0;
+
+    if (report->csv)
+        fprintf(report->csv, "%s,%s,%s,%zu,%llu,%.1f,%llu,%llu,%llu,%llu,%.0f\n",
+                report->benchmark, strategy, op, param, (unsigned long long) hist->total_count, mean,
+                (unsigned long long) hist_percentile(hist, 0.5), (unsigned long long) hist_percentile(hist, 0.99),
+                (unsigned long long) hist_percentile(hist, 0.999), (unsigned long long) hist->max_ns, ops_per_sec);
+
+    if (report->json)
+        fprintf(report->json,
+                "%s\n  {\"benchmark\": \"%s\", \"strategy\": \"%s\", \"op\": \"%s\", \"param\": %zu, \"count\": %llu, "
+                "\"mean_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+                "\"ops_per_sec\": %.0f}",
+                report->json_rows++ ? "," : "", report->benchmark, strategy, op, param,
+                (unsigned long long) hist->total_count, mean,
+                (unsigned long long) hist_percentile(hist, 0.5), (unsigned long long) hist_percentile(hist, 0.99),
+                (unsigned long long) hist_percentile(hist, 0.999), (unsigned long long) hist->max_ns, ops_per_sec);
+}
+
+/*
+ * Emit a result row for a benchmark that only times whole passes, so it has a mean but no
+ * per-operation distribution. The percentile columns are left empty.
+ */
+void bench_report_mean(bench_report *report, char *strategy, char *op, size_t param, uint64_t count, double mean)
+{
+    double ops_per_sec = mean > 0 ? 1e9 / mean : 0;
+
+    if (report->csv)
+        fprintf(report->csv, "%s,%s,%s,%zu,%llu,%.1f,,,,,%.0f\n",
+                report->benchmark, strategy, op, param, (unsigned long long) count, mean, ops_per_sec);
+
+    if (report->json)
+        fprintf(report->json,
+                "%s\n  {\"benchmark\": \"%s\", \"strategy\": \"%s\", \"op\": \"%s\", \"param\": %zu, \"count\": %llu, "
+                "\"mean_ns\": %.1f, \"p50_ns\": null, \"p99_ns\": null, \"p999_ns\": null, \"max_ns\": null, "
+                "\"ops_per_sec\": %.0f}",
+                report->json_rows++ ? "," : "", report->benchmark, strategy, op, param,
+                (unsigned long long) count, mean, ops_per_sec);
+}
+
+void bench_report_close(bench_report *report)
+{
+    if (report->csv)
+        fclose(report->csv);
+    if (report->json)
+    {
+        fprintf(report->json, "\n]\n");
+        fclose(report->json);
+    }
+}
+
+static void print_hist_header(void)
+{
+    printf("\t%-8s %10s %9s %9s %9s %9s %11s %12s\n",
+           "op", "count", "mean(ns)", "p50", "p99", "p99.9", "max", "ops/sec");
+}
+
+static void print_hist_row(char *op, const latency_hist *hist)
+{
+    printf("\t%-8s %10llu %9.1f %9llu %9llu %9llu %11llu %12.0f\n", op,
+           (unsigned long long) hist->total_count,
+           hist->total_count ? (double) hist->total_ns / hist->total_count : 0,
+           (unsigned long long) hist_percentile(hist, 0.5), (unsigned long long) hist_percentile(hist, 0.99),
+           (unsigned long long) hist_percentile(hist, 0.999), (unsigned long long) hist->max_ns,
+           hist->total_ns ? hist->total_count * 1e9 / hist->total_ns : 0);
+}
+
+/* Hot-path counters for the run that just finished, in "make instrumented" builds */
+static void print_instrumentation_if_enabled(void)
+{
+    mem_instr_t counters;
+    if (!mem_instr_read(&counters))
+        print_memory_instrumentation();
+}
+
+/* Snapshot the heap left by a run to <dump prefix>.<strategy> for memview */
+static void dump_heap_if_requested(int strategy)
+{
+    char path[4096];
+    FILE *out;
+
+    if (!bench_opts.dump_path)
+        return;
+
+    snprintf(path, sizeof(path), "%s.%s", bench_opts.dump_path, strategy_name(strategy));
+    out = fopen(path, "wb");
+    if (!out || mem_dump(fileno(out)))
+        perror(path);
+    if (out)
+        fclose(out);
+
+    // With -prof, the in-use profile of the same heap goes next to it
+    if (!bench_opts.prof_bytes)
+        return;
+    snprintf(path, sizeof(path), "%s.%s.folded", bench_opts.dump_path, strategy_name(strategy));
+    out = fopen(path, "w");
+    if (!out || mem_prof_dump(fileno(out), ProfInuseBytes) < 0)
+        perror(path);
+    if (out)
+        fclose(out);
+}
+
+/****** Benchmarks ******/
+
+/* Strategy range selected by the strategy argument, the same way the tests do it */
+static void strategy_bounds(int argc, char **argv, int *lbound, int *ubound)
+{
+    *lbound = 1;
+    *ubound = 4;
+    if (argc > 1 && strategyFromString(argv[1]) > 0)
+        *lbound = *ubound = strategyFromString(argv[1]);
+}
+
+/*
+ * Times every mymalloc and myfree individually under the same alloc/free pattern as
+ * do_randomized_test: allocate while less than fill_ratio of the pool is in use,
+ * otherwise (or after a failed allocation) free a random live block.
+ * Nothing but the allocator call sits between the two timestamps.
+ */
+static int bench_latency(int argc, char **argv)
+{
+    int lbound, ubound;
+    bench_report report;
+    static latency_hist malloc_hist, free_hist;
+    rng_t rng;
+
+    strategy_bounds(argc, argv, &lbound, &ubound);
+    if (bench_report_open(&report, "latency"))
+        return 1;
+
+    printf("Latency benchmark: pool size == %zu, fill ratio == %f, block size is from %zu to %zu, %ld iterations, clock %s\n",
+           bench_opts.pool_size, bench_opts.fill_ratio, bench_opts.min_block, bench_opts.max_block,
+           bench_opts.iterations, bench_clock_name());
+
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        size_t capacity = 1024;
+        void **pointers = malloc(capacity * sizeof(void *));
+        size_t *sizes = malloc(capacity * sizeof(size_t));
+        size_t stored = 0;
+        size_t live_bytes = 0;
+        size_t threshold = (size_t) (bench_opts.pool_size * bench_opts.fill_ratio);
+        int force_free = 0;
+        uint64_t start, end, wall_start;
+
+        hist_reset(&malloc_hist);
+        hist_reset(&free_hist);
+        mem_instr_reset();
+        rng_seed(&rng, bench_opts.seed);
+        initmem(strategy, bench_opts.pool_size);
+
+        wall_start = monotonic_ns();
+        for (long i = 0; i < bench_opts.iterations; i++)
+        {
+            if (!force_free && live_bytes < threshold)
+            {
+                size_t size = bench_opts.min_block + rng_below(&rng, bench_opts.max_block - bench_opts.min_block + 1);
+
+                start = bench_ticks();
+                void *pointer = mymalloc(size);
+                end = bench_ticks();
+                hist_record(&malloc_hist, bench_ticks_to_ns(end - start));
+
+                if (!pointer)
+                {
+                    force_free = 1;
+                    continue;
+                }
+                if (stored == capacity)
+                {
+                    capacity *= 2;
+                    pointers = realloc(pointers, capacity * sizeof(void *));
+                    sizes = realloc(sizes, capacity * sizeof(size_t));
+                }
+                pointers[stored] = pointer;
+                sizes[stored++] = size;
+                live_bytes += size;
+            }
+            else
+            {
+                force_free = 0;
+                if (!stored)
+                    continue;
+
+                size_t chosen = rng_below(&rng, stored);
+                void *pointer = pointers[chosen];
+                live_bytes -= sizes[chosen];
+                pointers[chosen] = pointers[--stored];
+                sizes[chosen] = sizes[stored];
+
+                start = bench_ticks();
+                myfree(pointer);
+                end = bench_ticks();
+                hist_record(&free_hist, bench_ticks_to_ns(end - start));
+            }
+        }
+
+        double wall_ms = (monotonic_ns() - wall_start) / 1e6;
+
+        printf("\t=== %s === (%.2fms wall)\n", strategy_name(strategy), wall_ms);
+        print_hist_header();
+        print_hist_row("mymalloc", &malloc_hist);
+        print_hist_row("myfree", &free_hist);
+        if (bench_opts.cache_per_size)
+        {
+            mem_stats_t st;
+            mem_stats(&st);
+            printf("\tcache hit rate %.1f%% (%llu hits, %llu misses)\n",
+                   100.0 * st.cache_hits / (st.cache_hits + st.cache_misses ? st.cache_hits + st.cache_misses : 1),
+                   st.cache_hits, st.cache_misses);
+        }
+        print_instrumentation_if_enabled();
+        dump_heap_if_requested(strategy);
+
+        bench_report_hist(&report, strategy_name(strategy), "mymalloc", bench_opts.pool_size, &malloc_hist);
+        bench_report_hist(&report, strategy_name(strategy), "myfree", bench_opts.pool_size, &free_hist);
+
+        free(pointers);
+        free(sizes);
+    }
+
+    bench_report_close(&report);
+    return 0;
+}
+
+/* Time a single expression into a histogram */
+#define TIME_OP(hist, expr) \
+    do { \
+        uint64_t op_start = bench_ticks(); \
+        expr; \
+        hist_record((hist), bench_ticks_to_ns(bench_ticks() - op_start)); \
+    } while (0)
+
+enum scaling_ops
+{
+    OpMalloc, OpFree, OpIsAlloc, OpLargestFree, OpSmallFree, OpCount
+};
+
+static char *scaling_op_names[OpCount] = {
+    "mymalloc", "myfree", "mem_is_alloc", "mem_largest_free", "mem_small_free"
+};
+
+/*
+ * Grows the pool one decade of live blocks at a time (10^2, 10^3, ... up to -max) and samples
+ * the cost of each operation at every level. Blocks are appended to the tail hole directly
+ * with allocate_block_of_memory(nextfit(...)), which is O(1) per block and identical for every
+ * strategy, so building a 10^6 block heap does not itself cost O(n^2). Each sample frees a random
+ * live block and allocates a block of the same size again through mymalloc, so the strategy
+ * under test decides where it goes and the live block count stays at the level.
+ */
+static int bench_scaling(int argc, char **argv)
+{
+    int lbound, ubound;
+    bench_report report;
+    static latency_hist hists[OpCount];
+    rng_t rng;
+    size_t min_block = bench_opts.block_sizes_given ? bench_opts.min_block : 1;
+    size_t max_block = bench_opts.block_sizes_given ? bench_opts.max_block : 32;
+    size_t small_block = max_block / 10;
+
+    strategy_bounds(argc, argv, &lbound, &ubound);
+    if (ubound > Next)
+    {
+        fprintf(stderr, "The scaling benchmark builds its heap on the memory list and needs a list strategy\n");
+        return 1;
+    }
+    if (bench_report_open(&report, "scaling"))
+        return 1;
+
+    printf("Scaling benchmark: up to %zu live blocks, block size is from %zu to %zu, clock %s\n",
+           bench_opts.max_live, min_block, max_block, bench_clock_name());
+
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        void **pointers = malloc(bench_opts.max_live * sizeof(void *));
+        size_t *sizes = malloc(bench_opts.max_live * sizeof(size_t));
+        size_t stored = 0;
+        void *pointer = NULL;
+        size_t largest = 0;
+        size_t small = 0;
+        char is_alloc = 0;
+
+        rng_seed(&rng, bench_opts.seed);
+        // The tail hole always has room for every sample to land there
+        initmem(strategy, (bench_opts.max_live + 4096) * max_block);
+
+        printf("\t=== %s ===\n\t%12s", strategy_name(strategy), "live blocks");
+        for (int op = 0; op < OpCount; op++)
+            printf(" %17s", scaling_op_names[op]);
+        printf("   (mean ns per call)\n");
+
+        for (size_t level = 100; level <= bench_opts.max_live; level *= 10)
+        {
+            // Keep the total work per level roughly constant, the scans are O(n)
+            size_t samples = 20000000 / level;
+            samples = samples < 50 ? 50 : samples > 5000 ? 5000 : samples;
+
+            while (stored < level)
+            {
+                size_t size = min_block + rng_below(&rng, max_block - min_block + 1);
+                pointers[stored] = allocate_block_of_memory(nextfit(size), size);
+                sizes[stored++] = size;
+            }
+
+            for (int op = 0; op < OpCount; op++)
+                hist_reset(&hists[op]);
+
+            for (size_t i = 0; i < samples; i++)
+            {
+                size_t chosen = rng_below(&rng, stored);
+                size_t probe = rng_below(&rng, stored);
+
+                TIME_OP(&hists[OpFree], myfree(pointers[chosen]));
+                TIME_OP(&hists[OpMalloc], pointer = mymalloc(sizes[chosen]));
+                assert(pointer);
+                pointers[chosen] = pointer;
+
+                TIME_OP(&hists[OpIsAlloc], is_alloc = mem_is_alloc(pointers[probe]));
+                TIME_OP(&hists[OpLargestFree], largest = mem_largest_free_bytes());
+                TIME_OP(&hists[OpSmallFree], small = mem_small_free_count(small_block));
+                assert(is_alloc == '1' && largest > 0 && small <= stored + 1);
+            }
+
+            printf("\t%12zu", level);
+            for (int op = 0; op < OpCount; op++)
+            {
+                printf(" %17.1f", (double) hists[op].total_ns / hists[op].total_count);
+                bench_report_hist(&report, strategy_name(strategy), scaling_op_names[op], level, &hists[op]);
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+
+        free(pointers);
+        free(sizes);
+    }
+
+    bench_report_close(&report);
+    return 0;
+}
+
+#define DISPATCH_LIVE 8
+#define DISPATCH_SIZES 4096
+#define DISPATCH_PASSES 5
+
+/*
+ * One timed pass of the small-heap fast path: each step frees the oldest of DISPATCH_LIVE live
+ * blocks and allocates a new one through alloc. Inlined with a constant alloc, so the loops
+ * for mymalloc and for the specialised entry point differ only in the call itself.
+ * @return mean nanoseconds per free and allocation pair
+ */
+static inline __attribute__((always_inline))
+double dispatch_pass(int strategy, void *(*alloc)(size_t), const size_t *sizes, long steps)
+{
+    void *live[DISPATCH_LIVE];
+    uint64_t start, end;
+
+    initmem(strategy, bench_opts.pool_size);
+    for (int i = 0; i < DISPATCH_LIVE; i++)
+        live[i] = mymalloc(sizes[i]);
+
+    start = bench_ticks();
+    for (long i = 0; i < steps; i++)
+    {
+        int slot = i % DISPATCH_LIVE;
+        myfree(live[slot]);
+        live[slot] = alloc(sizes[i & (DISPATCH_SIZES - 1)]);
+    }
+    end = bench_ticks();
+
+    return (double) bench_ticks_to_ns(end - start) / steps;
+}
+
+/*
+ * Compares runtime dispatch (mymalloc) with the strategy specialised entry points
+ * (mymalloc_first and friends) on a heap of a handful of blocks, where the search is a few
+ * nodes long and the dispatch is a visible part of the cost. The passes alternate and the best
+ * pass of each is reported; single operations are too short to time, so there are no
+ * percentiles.
+ */
+static int bench_dispatch(int argc, char **argv)
+{
+    int lbound, ubound;
+    bench_report report;
+    size_t sizes[DISPATCH_SIZES];
+    size_t max_block = bench_opts.block_sizes_given ? bench_opts.max_block : 64;
+    size_t min_block = bench_opts.block_sizes_given ? bench_opts.min_block : 16;
+    rng_t rng;
+
+    strategy_bounds(argc, argv, &lbound, &ubound);
+    if (ubound > Next || bench_opts.pool_size < DISPATCH_LIVE * 2 * max_block)
+    {
+        fprintf(stderr, "The dispatch benchmark needs a list strategy and room for %d blocks\n", DISPATCH_LIVE * 2);
+        return 1;
+    }
+    if (bench_report_open(&report, "dispatch"))
+        return 1;
+
+    rng_seed(&rng, bench_opts.seed);
+    for (int i = 0; i < DISPATCH_SIZES; i++)
+        sizes[i] = min_block + rng_below(&rng, max_block - min_block + 1);
+
+    printf("Dispatch benchmark: %d live blocks, block size is from %zu to %zu, %ld steps per pass, clock %s\n",
+           DISPATCH_LIVE, min_block, max_block, bench_opts.iterations, bench_clock_name());
+    printf("\t%-8s %14s %14s %9s   (best mean ns per free + malloc)\n", "strategy", "mymalloc", "specialised", "speedup");
+
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        double runtime = 0, fixed = 0;
+
+        for (int pass = 0; pass < DISPATCH_PASSES; pass++)
+        {
+            double ns = dispatch_pass(strategy, mymalloc, sizes, bench_opts.iterations);
+            runtime = pass && runtime < ns ? runtime : ns;
+
+            switch (strategy)
+            {
+                case Best:
+                    ns = dispatch_pass(strategy, mymalloc_best, sizes, bench_opts.iterations);
+                    break;
+                case Worst:
+                    ns = dispatch_pass(strategy, mymalloc_worst, sizes, bench_opts.iterations);
+                    break;
+                case First:
+                    ns = dispatch_pass(strategy, mymalloc_first, sizes, bench_opts.iterations);
+                    break;
+                default:
+                    ns = dispatch_pass(strategy, mymalloc_next, sizes, bench_opts.iterations);
+                    break;
+            }
+            fixed = pass && fixed < ns ? fixed : ns;
+        }
+
+        printf("\t%-8s %14.1f %14.1f %8.2fx\n", strategy_name(strategy), runtime, fixed, runtime / fixed);
+        bench_report_mean(&report, strategy_name(strategy), "mymalloc", DISPATCH_LIVE, bench_opts.iterations, runtime);
+        bench_report_mean(&report, strategy_name(strategy), "specialised", DISPATCH_LIVE, bench_opts.iterations, fixed);
+    }
+
+    bench_report_close(&report);
+    return 0;
+}
+
+#define LIFO_DEPTH 64
+#define LIFO_FRAME 8
+#define LIFO_PASSES 5
+
+/*
+ * One timed pass of nested frames, as a recursive descent parser makes them: each step either
+ * opens a frame of up to LIFO_FRAME allocations or closes the innermost one. Closing is a single
+ * mem_release when stacked, and myfree of the frame's blocks newest first otherwise. Both runs
+ * draw the same sequence of steps and sizes.
+ * @param stack_bytes size of the stack, 0 to allocate from the heap
+ * @param allocated set to the number of allocations the pass made
+ * @return mean nanoseconds per allocation, its free or release included, -1 if the stack could
+ * not be started
+ */
+static double lifo_pass(int strategy, size_t stack_bytes, const size_t *sizes, long steps, long *allocated)
+{
+    bool stacked = stack_bytes > 0;
+    static void *blocks[LIFO_DEPTH * LIFO_FRAME];
+    size_t marks[LIFO_DEPTH];
+    int counts[LIFO_DEPTH];
+    int depth = 0, live = 0;
+    long allocations = 0;
+    uint64_t start, end;
+    rng_t rng;
+
+    initmem(strategy, bench_opts.pool_size);
+    if (stacked && !mem_stack_begin(stack_bytes))
+        return -1;
+    rng_seed(&rng, bench_opts.seed);
+
+    start = bench_ticks();
+    for (long i = 0; i < steps; i++)
+    {
+        if (depth < LIFO_DEPTH && (!depth || rng_below(&rng, 2)))
+        {
+            int count = 1 + rng_below(&rng, LIFO_FRAME);
+            if (stacked)
+                marks[depth] = mem_mark();
+            for (int j = 0; j < count; j++)
+                blocks[live++] = mymalloc(sizes[allocations++ & (DISPATCH_SIZES - 1)]);
+            counts[depth++] = count;
+        }
+        else
+        {
+            depth--;
+            if (stacked)
+            {
+                mem_release(marks[depth]);
+                live -= counts[depth];
+            }
+            else
+                for (int j = 0; j < counts[depth]; j++)
+                    myfree(blocks[--live]);
+        }
+    }
+    end = bench_ticks();
+
+    if (stacked)
+        mem_stack_end();
+    *allocated = allocations;
+    return (double) bench_ticks_to_ns(end - start) / allocations;
+}
+
+/*
+ * Strictly LIFO allocation, the stack mode against the pool's own strategy doing the same
+ * allocations and frees. The mean of the best of LIFO_PASSES passes is reported.
+ */
+static int bench_lifo(int argc, char **argv)
+{
+    int lbound, ubound;
+    bench_report report;
+    size_t sizes[DISPATCH_SIZES];
+    size_t max_block = bench_opts.block_sizes_given ? bench_opts.max_block : 256;
+    size_t min_block = bench_opts.block_sizes_given ? bench_opts.min_block : 16;
+    size_t stack_bytes = LIFO_DEPTH * LIFO_FRAME * (max_block + _Alignof(max_align_t) - 1);
+    rng_t rng;
+
+    strategy_bounds(argc, argv, &lbound, &ubound);
+    if (bench_opts.pool_size < 2 * stack_bytes)
+    {
+        fprintf(stderr, "The lifo benchmark needs a pool of at least %zu bytes\n", 2 * stack_bytes);
+        return 1;
+    }
+    if (bench_report_open(&report, "lifo"))
+        return 1;
+
+    rng_seed(&rng, bench_opts.seed);
+    for (int i = 0; i < DISPATCH_SIZES; i++)
+        sizes[i] = min_block + rng_below(&rng, max_block - min_block + 1);
+
+    printf("LIFO benchmark: frames of 1 to %d blocks nested up to %d deep, block size is from %zu to %zu, %ld steps per pass, clock %s\n",
+           LIFO_FRAME, LIFO_DEPTH, min_block, max_block, bench_opts.iterations, bench_clock_name());
+    printf("\t%-8s %14s %14s %9s   (best mean ns per allocation)\n", "strategy", "malloc/free", "mark/release", "speedup");
+
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        double heap = 0, stack = 0;
+        long allocations = 0;
+
+        for (int pass = 0; pass < LIFO_PASSES; pass++)
+        {
+            double ns = lifo_pass(strategy, 0, sizes, bench_opts.iterations, &allocations);
+            heap = pass && heap < ns ? heap : ns;
+
+            ns = lifo_pass(strategy, stack_bytes, sizes, bench_opts.iterations, &allocations);
+            if (ns < 0)
+            {
+                fprintf(stderr, "Could not take a %zu byte stack from the heap with %s\n", stack_bytes, strategy_name(strategy));
+                bench_report_close(&report);
+                return 1;
+            }
+            stack = pass && stack < ns ? stack : ns;
+        }
+
+        printf("\t%-8s %14.1f %14.1f %8.2fx\n", strategy_name(strategy), heap, stack, heap / stack);
+        bench_report_mean(&report, strategy_name(strategy), "malloc/free", LIFO_DEPTH, allocations, heap);
+        bench_report_mean(&report, strategy_name(strategy), "mark/release", LIFO_DEPTH, allocations, stack);
+    }
+
+    bench_report_close(&report);
+    return 0;
+}
+
+#define SHARE_THREADS 4
+#define SHARE_PASSES 3
+
+typedef struct share_job
+{
+    pthread_t thread;
+    uint64_t *counter;
+    long increments;
+} share_job;
+
+static void *share_worker(void *arg)
+{
+    share_job *job = arg;
+    for (long i = 0; i < job->increments; i++)
+        __atomic_fetch_add(job->counter, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * One timed pass: SHARE_THREADS counters allocated one after the other from a shared pool, each
+ * then incremented by a thread of its own.
+ * @param colour_max passed to mem_set_line_colouring, 0 to pack the counters
+ * @param lines set to the number of cache lines the counters ended up on
+ * @return mean nanoseconds per increment
+ */
+static double share_pass(int strategy, size_t colour_max, long increments, int *lines)
+{
+    share_job jobs[SHARE_THREADS];
+    uint64_t start, end;
+
+    mem_set_line_colouring(colour_max, 1);
+    initmem(strategy, bench_opts.pool_size);
+    *lines = 0;
+    for (int i = 0; i < SHARE_THREADS; i++)
+    {
+        jobs[i].counter = mymalloc(sizeof(uint64_t));
+        jobs[i].increments = increments;
+        *jobs[i].counter = 0;
+        int shared = 0;
+        for (int j = 0; j < i; j++)
+            shared |= (uintptr_t) jobs[j].counter / 64 == (uintptr_t) jobs[i].counter / 64;
+        *lines += !shared;
+    }
+
+    start = bench_ticks();
+    for (int i = 0; i < SHARE_THREADS; i++)
+        pthread_create(&jobs[i].thread, NULL, share_worker, &jobs[i]);
+    for (int i = 0; i < SHARE_THREADS; i++)
+        pthread_join(jobs[i].thread, NULL);
+    end = bench_ticks();
+
+    mem_set_line_colouring(0, 1);
+    return (double) bench_ticks_to_ns(end - start) / (increments * SHARE_THREADS);
+}
+
+/*
+ * False sharing between threads: counters packed by the strategy against the same counters with
+ * line colouring. The pool is shared, so the allocations take the pool lock. The best of
+ * SHARE_PASSES passes is reported.
+ */
+static int bench_share(int argc, char **argv)
+{
+    int lbound, ubound;
+    bench_report report;
+    long increments = bench_opts.iterations * 10;
+
+    strategy_bounds(argc, argv, &lbound, &ubound);
+    if (bench_report_open(&report, "share"))
+        return 1;
+
+    mem_set_shared(true);
+    printf("Sharing benchmark: %d threads, %ld increments each of a counter from mymalloc, %ld online CPUs, clock %s\n",
+           SHARE_THREADS, increments, sysconf(_SC_NPROCESSORS_ONLN), bench_clock_name());
+    printf("\t%-8s %8s %10s %8s %10s %9s   (best mean ns per increment)\n", "strategy", "lines", "packed", "lines", "coloured", "speedup");
+
+    for (int strategy = lbound; strategy <= ubound; strategy++)
+    {
+        double packed = 0, coloured = 0;
+        int packed_lines = 0, coloured_lines = 0;
+
+        for (int pass = 0; pass < SHARE_PASSES; pass++)
+        {
+            double ns = share_pass(strategy, 0, increments, &packed_lines);
+            packed = pass && packed < ns ? packed : ns;
+
+            ns = share_pass(strategy, sizeof(uint64_t), increments, &coloured_lines);
+            coloured = pass && coloured < ns ? coloured : ns;
+        }
+
+        printf("\t%-8s %8d %10.2f %8d %10.2f %8.2fx\n", strategy_name(strategy), packed_lines, packed,
+               coloured_lines, coloured, packed / coloured);
+        bench_report_mean(&report, strategy_name(strategy), "packed", SHARE_THREADS, increments * SHARE_THREADS, packed);
+        bench_report_mean(&report, strategy_name(strategy), "coloured", SHARE_THREADS, increments * SHARE_THREADS, coloured);
+    }
+    mem_set_shared(false);
+
+    bench_report_close(&report);
+    return 0;
+}
+
+static benchentry_t benchmarks[] = {
+    {"latency", "per-call mymalloc/myfree latency percentiles", bench_latency},
+    {"scaling", "per-operation cost as the live block count grows by decades", bench_scaling},
+    {"dispatch", "runtime strategy dispatch against the specialised mymalloc entry points", bench_dispatch},
+    {"lifo", "strictly LIFO frames on the heap against the mark/release stack mode", bench_lifo},
+    {"share", "threads incrementing their own counters, packed against line-coloured", bench_share},
+};
+
+static void print_bench_usage(void)
+{
+    printf("Usage: mem -bench <benchmark> <strategy> [-n iterations] [-s pool size] [-b min max]\n"
+           "                  [-r fill ratio] [-max live blocks] [-seed n] [-csv file] [-json file]\n"
+           "                  [-defer threshold] [-cache blocks per size] [-dump file prefix] [-table]\n"
+           "                  [-prof mean bytes per sample] [-maint ms between passes] [-lazy]\n");
+    printf("\nValid benchmarks:\n");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchentry_t); i++)
+        printf("\t%-10s %s\n", benchmarks[i].name, benchmarks[i].description);
+    printf("Valid strategies: all ");
+    for (int i = 1; i <= Bitmap; i++)
+        printf("%s ", strategy_name(i));
+    printf("\n");
+}
+
+/**
+ * Entry point for "mem -bench <benchmark> <strategy> [options]"
+ * @return 0 if the benchmark ran, 1 on bad usage or an output error
+ */
+int run_memory_benchmarks(int argc, char **argv)
+{
+    bench_opts.pool_size = 1 << 20;
+    bench_opts.min_block = 1;
+    bench_opts.max_block = 1000;
+    bench_opts.block_sizes_given = 0;
+    bench_opts.max_live = 1000000;
+    bench_opts.fill_ratio = 0.5;
+    bench_opts.iterations = 200000;
+    bench_opts.seed = 1;
+    bench_opts.csv_path = NULL;
+    bench_opts.json_path = NULL;
+    bench_opts.dump_path = NULL;
+    bench_opts.defer_threshold = 0;
+    bench_opts.cache_per_size = 0;
+    bench_opts.block_table = 0;
+    bench_opts.prof_bytes = 0;
+    bench_opts.maintenance_ms = 0;
+    bench_opts.lazy_commit = 0;
+
+    if (argc < 3)
+    {
+        print_bench_usage();
+        return 1;
+    }
+
+    for (int i = 3; i < argc; i++)
+    {
+        int has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "-n") && has_value)
+            bench_opts.iterations = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && has_value)
+            bench_opts.pool_size = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-b") && i + 2 < argc)
+        {
+            bench_opts.min_block = strtoull(argv[++i], NULL, 10);
+            bench_opts.max_block = strtoull(argv[++i], NULL, 10);
+            bench_opts.block_sizes_given = 1;
+        }
+        else if (!strcmp(argv[i], "-max") && has_value)
+            bench_opts.max_live = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-r") && has_value)
+            bench_opts.fill_ratio = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-seed") && has_value)
+            bench_opts.seed = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-csv") && has_value)
+            bench_opts.csv_path = argv[++i];
+        else if (!strcmp(argv[i], "-json") && has_value)
+            bench_opts.json_path = argv[++i];
+        else if (!strcmp(argv[i], "-defer") && has_value)
+            bench_opts.defer_threshold = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-cache") && has_value)
+            bench_opts.cache_per_size = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-dump") && has_value)
+            bench_opts.dump_path = argv[++i];
+        else if (!strcmp(argv[i], "-table"))
+            bench_opts.block_table = 1;
+        else if (!strcmp(argv[i], "-prof") && has_value)
+            bench_opts.prof_bytes = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-maint") && has_value)
+            bench_opts.maintenance_ms = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-lazy"))
+            bench_opts.lazy_commit = 1;
+        else
+        {
+            fprintf(stderr, "Unknown or incomplete option '%s'\n", argv[i]);
+            print_bench_usage();
+            return 1;
+        }
+    }
+
+    if (bench_opts.min_block < 1 || bench_opts.max_block < bench_opts.min_block)
+    {
+        fprintf(stderr, "Block sizes must satisfy 1 <= min <= max\n");
+        return 1;
+    }
+
+    bench_clock_init();
+    mem_set_deferred_coalescing(bench_opts.defer_threshold);
+    mem_cache_configure(bench_opts.cache_per_size, bench_opts.pool_size / 8);
+    mem_set_block_table(bench_opts.block_table);
+    if (bench_opts.block_table)
+        printf("Block table enabled, %s scan\n", blocktable_scan_name());
+    mem_prof_enable(bench_opts.prof_bytes);
+    mem_set_maintenance(bench_opts.maintenance_ms);
+    mem_set_lazy_commit(bench_opts.lazy_commit);
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchentry_t); i++)
+        if (!strcmp(argv[1], benchmarks[i].name))
+            return benchmarks[i].bench_function(argc - 1, argv + 1);
+
+    fprintf(stderr, "Benchmark '%s' not found\n", argv[1]);
+    print_bench_usage();
+    return 1;
+}
@@ -0,0 +1,84 @@
+#ifndef MEMBENCH_H
+#define MEMBENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef int (*bench_fp) (int, char **);
+
+typedef struct
+{
+    char *name;
+    char *description;
+    bench_fp bench_function;
+} benchentry_t;
+
+/* Options shared by all benchmarks, parsed by run_memory_benchmarks */
+typedef struct
+{
+    size_t pool_size;
+    size_t min_block;
+    size_t max_block;
+    int block_sizes_given;
+    size_t max_live;
+    float fill_ratio;
+    long iterations;
+    size_t defer_threshold;
+    size_t cache_per_size;
+    int block_table;
+    size_t prof_bytes;
+    unsigned maintenance_ms;
+    int lazy_commit;
+    unsigned int seed;
+    char *csv_path;
+    char *json_path;
+    char *dump_path;
+} bench_options;
+
+extern bench_options bench_opts;
+
+/*
+ * HDR-style log-linear latency histogram over nanoseconds. Values below
+ * HIST_SUB_COUNT are exact, above that every power of two is split into
+ * HIST_SUB_COUNT / 2 buckets which keeps the relative error below 1/64.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SUB_HALF (HIST_SUB_COUNT / 2)
+#define HIST_MAGNITUDES 34
+#define HIST_BUCKETS (HIST_SUB_COUNT + HIST_MAGNITUDES * HIST_SUB_HALF)
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total_count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} latency_hist;
+
+void hist_reset(latency_hist *);
+void hist_record(latency_hist *, uint64_t);
+uint64_t hist_percentile(const latency_hist *, double);
+
+void bench_clock_init(void);
+uint64_t bench_ticks(void);
+uint64_t bench_ticks_to_ns(uint64_t);
+char *bench_clock_name(void);
+
+/* Machine-readable result rows shared by all benchmarks */
+typedef struct
+{
+    char *benchmark;
+    FILE *csv;
+    FILE *json;
+    int json_rows;
+} bench_report;
+
+int bench_report_open(bench_report *, char *);
+void bench_report_hist(bench_report *, char *, char *, size_t, const latency_hist *);
+void bench_report_mean(bench_report *, char *, char *, size_t, uint64_t, double);
+void bench_report_close(bench_report *);
+
+int run_memory_benchmarks(int, char **);
+
+#endif
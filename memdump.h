@@ -0,0 +1,68 @@
+#ifndef MEMDUMP_H
+#define MEMDUMP_H
+
+#include <stdint.h>
+
+/*
+ * Binary heap snapshot written by mem_dump and read by memview.
+ *
+ * Header, all fields little-endian:
+ *   char     magic[8]      "MYMEMDMP"
+ *   uint32_t version       MEMDUMP_VERSION
+ *   uint32_t strategy      the strategies value passed to initmem
+ *   uint64_t pool_size     bytes managed by the pool
+ *   uint64_t block_count   number of records that follow
+ *   uint64_t allocated     allocated bytes at the time of the dump
+ *
+ * Then one record per block in address order, each two LEB128 varints:
+ *   gap                    offset of the block minus the end of the previous block (0 normally)
+ *   size << 1 | alloc      block size and allocation bit
+ *
+ * A consistent heap has only zero gaps, so a record usually costs two or three bytes.
+ */
+#define MEMDUMP_MAGIC "MYMEMDMP"
+#define MEMDUMP_VERSION 1
+#define MEMDUMP_HEADER_SIZE 40
+#define MEMDUMP_MAX_VARINT 10
+
+static inline int memdump_put_varint(unsigned char *out, uint64_t value)
+{
+    int n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char) value;
+    return n;
+}
+
+static inline void memdump_put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static inline void memdump_put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static inline uint32_t memdump_get_u32(const unsigned char *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t) in[i] << (8 * i);
+    return value;
+}
+
+static inline uint64_t memdump_get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t) in[i] << (8 * i);
+    return value;
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include <pthread.h>
+
+#include "meminstr.h"
+
+#ifdef MYMEM_INSTRUMENT
+
+/*
+ * Every thread gets its own counter block on first use, so the hot paths never share a cache
+ * line or take a lock. Live blocks are linked into a registry that mem_instr_read sums up;
+ * when a thread exits its counts are folded into retired_counters and the block is released.
+ */
+typedef struct instr_block
+{
+    mem_instr_t counters;
+    struct instr_block *next;
+    struct instr_block *prev;
+} instr_block;
+
+__thread mem_instr_t *mem_instr_tls;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+static pthread_key_t registry_key;
+static instr_block *registry;
+static mem_instr_t retired_counters;
+
+static void add_search(mem_search_counter *to, const mem_search_counter *from)
+{
+    to->calls += from->calls;
+    to->visited += from->visited;
+    for (int i = 0; i < MEM_INSTR_BUCKETS; i++)
+        to->histogram[i] += from->histogram[i];
+}
+
+static void add_counters(mem_instr_t *to, const mem_instr_t *from)
+{
+    for (int i = 0; i < 5; i++)
+        add_search(&to->search[i], &from->search[i]);
+    add_search(&to->find_block, &from->find_block);
+    to->splits += from->splits;
+    to->merge_left_calls += from->merge_left_calls;
+    to->early_rejections += from->early_rejections;
+}
+
+/* Thread exit destructor: keep the counts, drop the block */
+static void retire_block(void *data)
+{
+    instr_block *block = data;
+
+    pthread_mutex_lock(&registry_lock);
+    add_counters(&retired_counters, &block->counters);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        registry = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    pthread_mutex_unlock(&registry_lock);
+
+    free(block);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&registry_key, retire_block);
+}
+
+/* Slow path of mem_instr_local: allocate and register this thread's counters */
+mem_instr_t *mem_instr_register(void)
+{
+    instr_block *block = calloc(1, sizeof(instr_block));
+
+    pthread_once(&registry_once, create_key);
+    pthread_setspecific(registry_key, block);
+
+    pthread_mutex_lock(&registry_lock);
+    block->next = registry;
+    if (registry)
+        registry->prev = block;
+    registry = block;
+    pthread_mutex_unlock(&registry_lock);
+
+    mem_instr_tls = &block->counters;
+    return mem_instr_tls;
+}
+
+void mem_instr_search(mem_search_counter *counter, size_t visited)
+{
+    int bucket = visited > 1 ? 63 - __builtin_clzll(visited) : 0;
+
+    counter->calls++;
+    counter->visited += visited;
+    counter->histogram[bucket < MEM_INSTR_BUCKETS ? bucket : MEM_INSTR_BUCKETS - 1]++;
+}
+
+/**
+ * Sum the counters of every thread, including threads that already exited.
+ * Other threads keep counting while this runs, so the totals are a close but not atomic snapshot.
+ * @param out receives the aggregated counters
+ * @return 0, or -1 when the allocator was built without MYMEM_INSTRUMENT
+ */
+int mem_instr_read(mem_instr_t *out)
+{
+    pthread_mutex_lock(&registry_lock);
+    *out = retired_counters;
+    for (instr_block *block = registry; block; block = block->next)
+        add_counters(out, &block->counters);
+    pthread_mutex_unlock(&registry_lock);
+
+    return 0;
+}
+
+/* Zero the counters of every thread */
+void mem_instr_reset(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    memset(&retired_counters, 0, sizeof(retired_counters));
+    for (instr_block *block = registry; block; block = block->next)
+        memset(&block->counters, 0, sizeof(block->counters));
+    pthread_mutex_unlock(&registry_lock);
+}
+
+#else
+
+int mem_instr_read(mem_instr_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    return -1;
+}
+
+void mem_instr_reset(void)
+{
+}
+
+#endif
+
+static void print_search(char *name, const mem_search_counter *counter)
+{
+    if (!counter->calls)
+        return;
+
+    printf("\t%-11s %10llu calls, %10.1f nodes/call; length histogram:", name, counter->calls,
+           (double) counter->visited / counter->calls);
+    for (int i = 0; i < MEM_INSTR_BUCKETS; i++)
+        if (counter->histogram[i])
+            printf(" %llu:%llu", i ? 1ull << i : 0ull, counter->histogram[i]);
+    printf("\n");
+}
+
+/* Print the hot-path counters, e.g. after a benchmark run */
+void print_memory_instrumentation(void)
+{
+    mem_instr_t counters;
+
+    if (mem_instr_read(&counters))
+    {
+        printf("\tInstrumentation is not compiled in; build with \"make instrumented\".\n");
+        return;
+    }
+
+    for (int strategy = 1; strategy < 5; strategy++)
+        print_search(strategy_name(strategy), &counters.search[strategy]);
+    print_search("find_block", &counters.find_block);
+    printf("\tsplits %llu, merge_left calls %llu, early rejections %llu\n",
+           counters.splits, counters.merge_left_calls, counters.early_rejections);
+}
@@ -0,0 +1,40 @@
+#ifndef MEMINSTR_H
+#define MEMINSTR_H
+
+#include "mymem.h"
+
+/*
+ * Instrumentation macros for the allocator hot paths. Without MYMEM_INSTRUMENT they expand to
+ * nothing, so the uninstrumented build carries no counters, branches or thread-local lookups.
+ *
+ *   INSTR_DECLARE(var)        declare a local search-length counter
+ *   INSTR_STEP(var)           count one visited node
+ *   INSTR_SEARCH(field, var)  record a finished search into the mem_search_counter field
+ *   INSTR_COUNT(field)        bump a plain counter
+ */
+#ifdef MYMEM_INSTRUMENT
+
+extern __thread mem_instr_t *mem_instr_tls;
+mem_instr_t *mem_instr_register(void);
+void mem_instr_search(mem_search_counter *, size_t);
+
+static inline mem_instr_t *mem_instr_local(void)
+{
+    return mem_instr_tls ? mem_instr_tls : mem_instr_register();
+}
+
+#define INSTR_DECLARE(var) size_t var = 0
+#define INSTR_STEP(var) ((var)++)
+#define INSTR_SEARCH(field, var) mem_instr_search(&mem_instr_local()->field, (var))
+#define INSTR_COUNT(field) (mem_instr_local()->field++)
+
+#else
+
+#define INSTR_DECLARE(var)
+#define INSTR_STEP(var) ((void) 0)
+#define INSTR_SEARCH(field, var) ((void) 0)
+#define INSTR_COUNT(field) ((void) 0)
+
+#endif
+
+#endif
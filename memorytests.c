@@ -1,147 +1,212 @@
 #include "mymem.h"
 #include "testrunner.h"
+#include "membench.h"
+#include "workload.h"
+#include "memdump.h"
+#include "blocktable.h"
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* One stress configuration; it runs once per selected strategy */
+typedef struct
+{
+	char header[256];
+	workload load;
+	int totalSize;
+	int smallBlockSize;
+} stress_config;
+
+#define MAX_STRESS_CONFIGS 32
 
-/* performs a randomized test:
+static stress_config stress_configs[MAX_STRESS_CONFIGS];
+static int stress_config_count;
+static int stress_lbound, stress_ubound;
+
+/* queues a randomized test:
 	totalSize == the total size of the memory pool, as passed to initmem2
-		totalSize must be less than 10,000 * minBlockSize
 	fillRatio == when the allocated memory is >= fillRatio * totalSize, a block is freed;
 		otherwise, a new block is allocated.
 		If a block cannot be allocated, this is tallied and a random block is freed immediately thereafter in the next iteration
 	minBlockSize, maxBlockSize == size for allocated blocks is picked uniformly at random between these two numbers, inclusive
+	The random sequence comes from a fixed seed, so every run and every strategy sees the same requests.
 	*/
-void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int minBlockSize, int maxBlockSize, int iterations)
+void do_randomized_test(int totalSize, float fillRatio, int minBlockSize, int maxBlockSize, int iterations)
 {
-	void * pointers[10000];
-	int storedPointers = 0;
-	int strategy;
-	int lbound = 1;
-	int ubound = 4;
-	int smallBlockSize = maxBlockSize/10;
-
-	if (strategyToUse>0)
-		lbound=ubound=strategyToUse;
-
-	FILE *log;
-	log = fopen("tests.log","a");
-	if(log == NULL) {
-	  perror("Can't append to log file.\n");
-	  return;
-	}
-
-	fprintf(log,"Running randomized tests: pool size == %d, fill ratio == %f, block size is from %d to %d, %d iterations\n",totalSize,fillRatio,minBlockSize,maxBlockSize,iterations);
-
-	fclose(log);
-
-	for (strategy = lbound; strategy <= ubound; strategy++)
-	{
-		double sum_largest_free = 0;
-		double sum_hole_size = 0;
-		double sum_allocated = 0;
-		int failed_allocations = 0;
-		double sum_small = 0;
-		struct timespec execstart, execend;
-		int force_free = 0;
-		int i;
-		storedPointers = 0;
-
-		initmem(strategy,totalSize);
-
-		clock_gettime(CLOCK_REALTIME, &execstart);
-
-		for (i = 0; i < iterations; i++)
-		{
-			if ( (i % 10000)==0 )
-				srand ( time(NULL) );
-			if (!force_free && (mem_free() > (totalSize * (1-fillRatio))))
-			{
-				int newBlockSize = (rand()%(maxBlockSize-minBlockSize+1))+minBlockSize;
-				/* allocate */
-				void * pointer = mymalloc(newBlockSize);
-				if (pointer != NULL)
-					pointers[storedPointers++] = pointer;
-				else
-				{ 
-					failed_allocations++;
-					force_free = 1;
-				}
-			}
-			else
-			{
-				int chosen;
-				void * pointer;
-
-				/* free */
-				force_free = 0;
-
-				if (storedPointers == 0)
-					continue;
-
-				chosen = rand() % storedPointers;
-				pointer = pointers[chosen];
-				pointers[chosen] = pointers[storedPointers-1];
-
-				storedPointers--;
-
-				myfree(pointer);
-			}
+	stress_config *config;
+
+	assert(stress_config_count < MAX_STRESS_CONFIGS);
+	config = &stress_configs[stress_config_count++];
+	memset(config, 0, sizeof(*config));
+
+	snprintf(config->header,sizeof(config->header),"Running randomized tests: pool size == %d, fill ratio == %f, block size is from %d to %d, %d iterations\n",totalSize,fillRatio,minBlockSize,maxBlockSize,iterations);
+	config->load.name = "uniform";
+	config->load.seed = 1;
+	config->load.phase_count = 1;
+	config->load.phases[0].iterations = iterations;
+	config->load.phases[0].fill_start = config->load.phases[0].fill_end = fillRatio;
+	config->load.phases[0].sizes.generate = size_uniform;
+	config->load.phases[0].sizes.min = minBlockSize;
+	config->load.phases[0].sizes.max = maxBlockSize;
+	config->totalSize = totalSize;
+	config->smallBlockSize = maxBlockSize/10;
+}
 
-			sum_largest_free += mem_largest_free();
-			sum_hole_size += (mem_free() / mem_holes());
-			sum_allocated += mem_allocated();
-			sum_small += mem_small_free(smallBlockSize);
-		}
+/* queues a named workload */
+void do_workload_test(int totalSize, const workload *load, int smallBlockSize)
+{
+	stress_config *config;
 
-		clock_gettime(CLOCK_REALTIME, &execend);
+	assert(stress_config_count < MAX_STRESS_CONFIGS);
+	config = &stress_configs[stress_config_count++];
 
-		log = fopen("tests.log","a");
-		if(log == NULL) {
-		  perror("Can't append to log file.\n");
-		  return;
-		}
-		
-		fprintf(log,"\t=== %s ===\n",strategy_name(strategy));
-		fprintf(log,"\tTest took %.2fms.\n", (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0);
-		fprintf(log,"\tAverage hole size: %f\n",sum_hole_size/iterations);
-		fprintf(log,"\tAverage largest free block: %f\n",sum_largest_free/iterations);
-		fprintf(log,"\tAverage allocated bytes: %f\n",sum_allocated/iterations);
-		fprintf(log,"\tAverage number of small blocks: %f\n",sum_small/iterations);
-		fprintf(log,"\tFailed allocations: %d\n",failed_allocations);
-		fclose(log);
+	snprintf(config->header,sizeof(config->header),"Running workload '%s': pool size == %d, %d phases, %ld iterations, seed %llu\n",load->name,totalSize,load->phase_count,workload_iterations(load),(unsigned long long)load->seed);
+	config->load = *load;
+	config->totalSize = totalSize;
+	config->smallBlockSize = smallBlockSize;
+}
 
+/* runs in a worker process: job number -> (configuration, strategy) */
+static void run_stress_job(int job, void *result)
+{
+	int strategies_per_config = stress_ubound - stress_lbound + 1;
+	stress_config *config = &stress_configs[job / strategies_per_config];
+	int strategy = stress_lbound + job % strategies_per_config;
 
-	}
+	run_workload(strategy, config->totalSize, &config->load, config->smallBlockSize, result);
 }
 
-/* run randomized tests against the various strategies with various parameters */
+/* workloads that look more like production traffic than uniform sizes with random frees */
+static const workload power_law_workload = {
+	.name = "power-law", .seed = 42, .phase_count = 1,
+	.phases = {
+		{ .iterations = 10000, .fill_start = 0.75, .fill_end = 0.75,
+		  .sizes = { .generate = size_power_law, .min = 8, .max = 8192, .alpha = 1.2 } },
+	},
+};
+
+static const workload bimodal_lifetime_workload = {
+	.name = "bimodal-lifetimes", .seed = 42, .phase_count = 1,
+	.phases = {
+		{ .iterations = 20000, .fill_start = 0.9, .fill_end = 0.9,
+		  .sizes = { .generate = size_bimodal, .min = 16, .small_max = 64, .large_min = 1024, .max = 4096, .small_fraction = 0.9 },
+		  .lifetimes = { .generate = lifetime_exponential_mix, .short_fraction = 0.9, .short_mean = 20, .long_mean = 5000 } },
+	},
+};
+
+static const workload phased_ramp_workload = {
+	.name = "phased-ramp", .seed = 42, .phase_count = 3,
+	.phases = {
+		/* ramp-up: many small, mostly long-lived objects */
+		{ .iterations = 5000, .fill_start = 0.1, .fill_end = 0.9,
+		  .sizes = { .generate = size_uniform, .min = 16, .max = 256 },
+		  .lifetimes = { .generate = lifetime_exponential_mix, .short_fraction = 0.2, .short_mean = 50, .long_mean = 20000 } },
+		/* steady state: heavy-tailed sizes, mostly short-lived */
+		{ .iterations = 10000, .fill_start = 0.9, .fill_end = 0.9,
+		  .sizes = { .generate = size_power_law, .min = 16, .max = 16384, .alpha = 1.1 },
+		  .lifetimes = { .generate = lifetime_exponential_mix, .short_fraction = 0.95, .short_mean = 30, .long_mean = 3000 } },
+		/* ramp-down with large blocks */
+		{ .iterations = 5000, .fill_start = 0.9, .fill_end = 0.1,
+		  .sizes = { .generate = size_uniform, .min = 2048, .max = 8192 } },
+	},
+};
+
+/* run randomized tests against the various strategies with various parameters.
+	The configurations are fanned out to worker processes (see run_parallel_jobs) and the
+	results are written in order to tests.log, and as one row per run to tests.csv. */
 int do_stress_tests(int argc, char **argv)
 {
 	int strategy = strategyFromString(*(argv+1));
+	int strategies_per_config, job_count, failed_jobs, job;
+	workload_result *results;
+	int *job_status;
+	FILE *log, *csv;
+	workload hinted;
+
+	stress_lbound = 1;
+	stress_ubound = 4;
+	if (strategy>0)
+		stress_lbound=stress_ubound=strategy;
+	stress_config_count = 0;
+
+	do_randomized_test(10000,0.25,1,1000,10000);
+	do_randomized_test(10000,0.25,1,2000,10000);
+	do_randomized_test(10000,0.25,1000,2000,10000);
+	do_randomized_test(10000,0.25,1,3000,10000);
+	do_randomized_test(10000,0.25,1,4000,10000); 
+	do_randomized_test(10000,0.25,1,5000,10000);
+
+	do_randomized_test(10000,0.5,1,1000,10000);
+	do_randomized_test(10000,0.5,1,2000,10000);
+	do_randomized_test(10000,0.5,1000,2000,10000);
+	do_randomized_test(10000,0.5,1,3000,10000); 
+	do_randomized_test(10000,0.5,1,4000,10000);
+	do_randomized_test(10000,0.5,1,5000,10000);
+
+	do_randomized_test(10000,0.5,1000,1000,10000); /* watch what happens with this test!...why? */
+
+	do_randomized_test(10000,0.75,1,1000,10000);
+	do_randomized_test(10000,0.75,500,1000,10000);
+	do_randomized_test(10000,0.75,1,2000,10000); 
+
+	do_randomized_test(10000,0.9,1,500,10000); 
+
+	do_workload_test(1<<15,&power_law_workload,64);
+	do_workload_test(1<<18,&bimodal_lifetime_workload,64);
+	do_workload_test(1<<17,&phased_ramp_workload,64);
+
+	/* the same requests again, with every allocation hinted short- or long-lived */
+	hinted = bimodal_lifetime_workload;
+	hinted.name = "bimodal-lifetimes-hinted";
+	hinted.lifetime_hints = 1;
+	do_workload_test(1<<18,&hinted,64);
+	hinted = phased_ramp_workload;
+	hinted.name = "phased-ramp-hinted";
+	hinted.lifetime_hints = 1;
+	do_workload_test(1<<17,&hinted,64);
+
+	strategies_per_config = stress_ubound - stress_lbound + 1;
+	job_count = stress_config_count * strategies_per_config;
+	results = calloc(job_count, sizeof(workload_result));
+	job_status = calloc(job_count, sizeof(int));
+
+	failed_jobs = run_parallel_jobs(run_stress_job, job_count, results, sizeof(workload_result), job_status);
 
 	unlink("tests.log");  // We want a new log file
+	log = fopen("tests.log","w");
+	csv = fopen("tests.csv","w");
+	if(log == NULL || csv == NULL) {
+	  perror("Can't create log file.\n");
+	  return 1;
+	}
 
-	do_randomized_test(strategy,10000,0.25,1,1000,10000);
-	do_randomized_test(strategy,10000,0.25,1,2000,10000);
-	do_randomized_test(strategy,10000,0.25,1000,2000,10000);
-	do_randomized_test(strategy,10000,0.25,1,3000,10000);
-	do_randomized_test(strategy,10000,0.25,1,4000,10000); 
-	do_randomized_test(strategy,10000,0.25,1,5000,10000);
-
-	do_randomized_test(strategy,10000,0.5,1,1000,10000);
-	do_randomized_test(strategy,10000,0.5,1,2000,10000);
-	do_randomized_test(strategy,10000,0.5,1000,2000,10000);
-	do_randomized_test(strategy,10000,0.5,1,3000,10000); 
-	do_randomized_test(strategy,10000,0.5,1,4000,10000);
-	do_randomized_test(strategy,10000,0.5,1,5000,10000);
-
-	do_randomized_test(strategy,10000,0.5,1000,1000,10000); /* watch what happens with this test!...why? */
-
-	do_randomized_test(strategy,10000,0.75,1,1000,10000);
-	do_randomized_test(strategy,10000,0.75,500,1000,10000);
-	do_randomized_test(strategy,10000,0.75,1,2000,10000); 
+	fprintf(csv,"config,workload,pool_size,strategy,status,elapsed_ms,avg_hole_size,avg_largest_free,avg_allocated,avg_small_blocks,failed_allocations,peak_live_blocks\n");
+	for (job = 0; job < job_count; job++)
+	{
+		int config = job / strategies_per_config;
+		int strategy = stress_lbound + job % strategies_per_config;
+		workload_result *result = &results[job];
+		long iterations = result->iterations ? result->iterations : 1;
+
+		if (job % strategies_per_config == 0)
+			fputs(stress_configs[config].header, log);
+		if (job_status[job])
+			fprintf(log,"\t=== %s ===\n\tWorker failed with status %d\n",strategy_name(strategy),job_status[job]);
+		else
+			log_workload_result(log, strategy, result);
+
+		fprintf(csv,"%d,%s,%d,%s,%d,%.2f,%f,%f,%f,%f,%d,%zu\n",config,stress_configs[config].load.name,
+			stress_configs[config].totalSize,strategy_name(strategy),job_status[job],result->elapsed_ms,
+			result->sum_hole_size/iterations,result->sum_largest_free/iterations,result->sum_allocated/iterations,
+			result->sum_small/iterations,result->failed_allocations,result->peak_live_blocks);
+	}
 
-	do_randomized_test(strategy,10000,0.9,1,500,10000); 
+	fclose(log);
+	fclose(csv);
+	free(results);
+	free(job_status);
 
-	return 0; /* you nominally pass for surviving without segfaulting */
+	return failed_jobs != 0; /* you nominally pass for surviving without segfaulting */
 }
 
 /* basic sequential allocation of single byte blocks */
@@ -152,6 +217,8 @@ int test_alloc_1(int argc, char **argv) {
 
 	if (strategyFromString(*(argv+1))>0)
 		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
 
 	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
@@ -205,6 +272,8 @@ int test_alloc_2(int argc, char **argv) {
 
 	if (strategyFromString(*(argv+1))>0)
 		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
 
 	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
@@ -256,6 +325,7 @@ int test_alloc_2(int argc, char **argv) {
 				correct_largest_free = 88;
 				break;
 		        case NotSet:
+		        case Bitmap:
 			        break;
 		}
 
@@ -303,6 +373,8 @@ int test_alloc_3(int argc, char **argv) {
 
 	if (strategyFromString(*(argv+1))>0)
 		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
 
 	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
@@ -373,6 +445,8 @@ int test_alloc_4(int argc, char **argv) {
 
 	if (strategyFromString(*(argv+1))>0)
 		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
 
 	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
@@ -434,6 +508,1270 @@ int test_alloc_4(int argc, char **argv) {
 }
 
 
+/* fragmentation telemetry after sequential allocation, 50 frees and then freeing everything */
+int test_stats(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_stats_t st;
+		int i;
+
+		initmem(strategy,100);
+		for (i = 0; i < 100; i++)
+			mymalloc(1);
+		for (i = 1; i < 100; i+= 2)
+			myfree(mem_pool() + i);
+
+		mem_stats(&st);
+		if (st.holes != 50 || st.hole_histogram[0] != 50 || st.allocated_bytes != 50 || st.free_bytes != 50 || st.largest_free != 1)
+		{
+			printf("Stats report %zu holes (%zu of 1 byte), %zu allocated, %zu free, largest %zu with %s\n", st.holes, st.hole_histogram[0], st.allocated_bytes, st.free_bytes, st.largest_free, strategy_name(strategy));
+			return 1;
+		}
+
+		if (st.splits != 99 || st.merges != 0 || st.blocks != 100 || st.fragmentation < 0.979 || st.fragmentation > 0.981)
+		{
+			printf("Stats report %llu splits, %llu merges, %zu blocks, fragmentation %f with %s\n", st.splits, st.merges, st.blocks, st.fragmentation, strategy_name(strategy));
+			return 1;
+		}
+
+		for (i = 0; i < 100; i+= 2)
+			myfree(mem_pool() + i);
+		if (mymalloc(101) != NULL)
+		{
+			printf("Allocation larger than the pool succeeded with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		mem_stats(&st);
+		if (st.holes != 1 || st.hole_histogram[6] != 1 || st.merges != 99 || st.blocks != 1 || st.fragmentation != 0 || st.failed_allocations != 1)
+		{
+			printf("Stats after freeing everything report %zu holes, %llu merges, %zu blocks, fragmentation %f, %llu failed with %s\n", st.holes, st.merges, st.blocks, st.fragmentation, st.failed_allocations, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* a heap snapshot lists every block in address order with the right sizes */
+int test_dump(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		unsigned char buffer[1024];
+		int fds[2];
+		ssize_t length;
+		int i, pos, block;
+
+		initmem(strategy,1000);
+		for (i = 0; i < 10; i++)
+			mymalloc(100 - 10*i);
+		myfree(mem_pool());
+		myfree(mem_pool() + 190);
+
+		if (pipe(fds) || mem_dump(fds[1]))
+		{
+			printf("mem_dump failed with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		close(fds[1]);
+		length = read(fds[0], buffer, sizeof(buffer));
+		close(fds[0]);
+
+		if (length < MEMDUMP_HEADER_SIZE || memcmp(buffer, MEMDUMP_MAGIC, 8) ||
+		    memdump_get_u32(buffer+12) != strategy || memdump_get_u64(buffer+16) != 1000 ||
+		    memdump_get_u64(buffer+24) != 11 || memdump_get_u64(buffer+32) != 550-100-80)
+		{
+			printf("Snapshot header is wrong with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* every record is a zero gap and a one or two byte size word */
+		for (pos = MEMDUMP_HEADER_SIZE, block = 0; pos < length; block++)
+		{
+			int size = 100 - 10*block;
+			int alloc = block != 0 && block != 2;
+			int word = buffer[pos+1] & 0x7f;
+
+			if (block == 10)
+			{
+				size = 450;
+				alloc = 0;
+			}
+			if (buffer[pos+1] & 0x80)
+				word |= buffer[pos+2] << 7;
+
+			if (buffer[pos] != 0 || word != (size << 1 | alloc))
+			{
+				printf("Snapshot record %d is wrong with %s\n", block, strategy_name(strategy));
+				return 1;
+			}
+			pos += (buffer[pos+1] & 0x80) ? 3 : 2;
+		}
+
+		if (block != 11)
+		{
+			printf("Snapshot has %d records instead of 11 with %s\n", block, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* deferred coalescing recycles exact-size frees and still never shows adjacent holes */
+int test_deferred(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_stats_t before, after;
+		int i;
+
+		initmem(strategy,100);
+		mem_set_deferred_coalescing(8);
+
+		for (i = 0; i < 100; i++)
+			mymalloc(1);
+		for (i = 1; i < 100; i+= 2)
+			myfree(mem_pool() + i);
+
+		if (mem_holes() != 50 || mem_allocated() != 50 || mem_largest_free() != 1)
+		{
+			printf("Deferred frees not coalesced before the status queries with %s\n", strategy_name(strategy));
+			mem_set_deferred_coalescing(0);
+			return 1;
+		}
+
+		/* a burst of frees followed by same-size allocations reuses the blocks in LIFO order */
+		mem_stats(&before);
+		for (i = 0; i < 100; i+= 20)
+			myfree(mem_pool() + i);
+		for (i = 80; i >= 0; i-= 20)
+		{
+			if (mymalloc(1) != mem_pool() + i)
+			{
+				printf("Deferred free of byte %d was not recycled with %s\n", i, strategy_name(strategy));
+				mem_set_deferred_coalescing(0);
+				return 1;
+			}
+		}
+		mem_stats(&after);
+
+		if (after.merges != before.merges || after.splits != before.splits || after.deferred_reuses != before.deferred_reuses + 5)
+		{
+			printf("Recycling deferred frees split or merged blocks with %s\n", strategy_name(strategy));
+			mem_set_deferred_coalescing(0);
+			return 1;
+		}
+
+		/* freeing everything coalesces into one hole once somebody looks */
+		for (i = 0; i < 100; i+= 2)
+			myfree(mem_pool() + i);
+		mem_set_deferred_coalescing(0);
+		if (mem_holes() != 1 || mem_largest_free() != 100)
+		{
+			printf("Holes counted as %d, largest %d after freeing everything with %s\n", mem_holes(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* the exact-size cache hands back the last freed block and flushes back to strict semantics */
+int test_cache(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_stats_t st;
+		mem_block_info info;
+		void *freed;
+		int i;
+
+		initmem(strategy,100);
+		mem_cache_configure(2,30);
+		for (i = 0; i < 10; i++)
+			mymalloc(10);
+
+		/* three frees of the same size: two fit the bin, the third really is freed; the counters
+		   still count the cached two as allocated, the per-block queries report them as free */
+		myfree(mem_pool() + 10);
+		myfree(mem_pool() + 30);
+		myfree(mem_pool() + 50);
+		freed = mem_pool() + 30;
+
+		mem_stats(&st);
+		if (st.cached_blocks != 2 || st.cached_bytes != 20 || mem_allocated() != 90 || mem_holes() != 1 || mem_is_alloc(freed) != '0' ||
+		    !mem_block_of(freed, &info) || info.alloc)
+		{
+			printf("Cache holds %zu blocks (%zu bytes), %d allocated, %d holes with %s\n", st.cached_blocks, st.cached_bytes, mem_allocated(), mem_holes(), strategy_name(strategy));
+			mem_cache_configure(0,0);
+			return 1;
+		}
+
+		if (mymalloc(10) != freed || mymalloc(10) != mem_pool() + 10)
+		{
+			printf("Cache did not return the blocks in LIFO order with %s\n", strategy_name(strategy));
+			mem_cache_configure(0,0);
+			return 1;
+		}
+
+		mem_stats(&st);
+		if (st.cache_hits != 2 || st.cached_blocks != 0)
+		{
+			printf("Cache reports %llu hits and %zu blocks with %s\n", st.cache_hits, st.cached_blocks, strategy_name(strategy));
+			mem_cache_configure(0,0);
+			return 1;
+		}
+
+		/* flushing returns cached blocks to the heap where the strategy sees them */
+		myfree(mem_pool() + 70);
+		myfree(mem_pool() + 80);
+		mem_cache_flush();
+		mem_cache_configure(0,0);
+		if (mem_allocated() != 70 || mem_holes() != 2 || mem_largest_free() != 20)
+		{
+			printf("After the flush %d allocated, %d holes, largest %d with %s\n", mem_allocated(), mem_holes(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* next-fit carries on after the last allocation and the free list survives random churn */
+int test_freelist(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	int order[] = {20, 60, 90, 0};
+	void *blocks[64];
+	rng_t rng;
+	int i;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	if (lbound <= Next && ubound >= Next)
+	{
+		initmem(Next,100);
+		for (i = 0; i < 10; i++)
+			mymalloc(10);
+		myfree(mem_pool() + 20);
+		myfree(mem_pool() + 60);
+		if (mymalloc(10) != mem_pool() + order[0])
+		{
+			printf("Next fit did not wrap around to the first hole\n");
+			return 1;
+		}
+		myfree(mem_pool() + 0);
+		myfree(mem_pool() + 90);
+		for (i = 1; i < 4; i++)
+		{
+			if (mymalloc(10) != mem_pool() + order[i])
+			{
+				printf("Next fit allocation %d did not land at byte %d\n", i, order[i]);
+				return 1;
+			}
+		}
+	}
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		rng_seed(&rng, 35);
+		memset(blocks, 0, sizeof(blocks));
+		initmem(strategy,4096);
+
+		for (i = 0; i < 20000; i++)
+		{
+			int slot = rng_below(&rng, 64);
+			if (blocks[slot])
+			{
+				myfree(blocks[slot]);
+				blocks[slot] = NULL;
+			}
+			else
+				blocks[slot] = mymalloc(1 + rng_below(&rng, 128));
+
+			if (mem_check())
+			{
+				printf("Memory list inconsistent after %d operations with %s\n", i + 1, strategy_name(strategy));
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/* Random churn that records where every allocation landed */
+static void table_churn(strategies strategy, void **placed, int count)
+{
+	void *blocks[64] = {NULL};
+	rng_t rng;
+	int i;
+
+	rng_seed(&rng, 36);
+	initmem(strategy,4096);
+	for (i = 0; i < count; i++)
+	{
+		int slot = rng_below(&rng, 64);
+		if (blocks[slot])
+		{
+			myfree(blocks[slot]);
+			blocks[slot] = NULL;
+			placed[i] = NULL;
+		}
+		else
+			placed[i] = blocks[slot] = mymalloc(1 + rng_below(&rng, 128));
+	}
+}
+
+/* the block table places every block where the memory list does, with every scan the CPU has */
+int test_blocktable(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	char *scans[] = {"scalar", "sse4.2", "avx2"};
+	static void *expected[5000], *placed[5000];
+	int s, i;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_set_block_table(false);
+		table_churn(strategy, expected, 5000);
+
+		for (s = 0; s < 3; s++)
+		{
+			if (blocktable_set_scan(scans[s]))
+				continue;
+
+			mem_set_block_table(true);
+			table_churn(strategy, placed, 5000);
+			for (i = 0; i < 5000; i++)
+			{
+				if (placed[i] != expected[i])
+				{
+					printf("Operation %d placed differently with the %s table scan and %s\n", i, scans[s], strategy_name(strategy));
+					mem_set_block_table(false);
+					return 1;
+				}
+			}
+
+			if (mem_check())
+			{
+				printf("Block table inconsistent with the %s scan and %s\n", scans[s], strategy_name(strategy));
+				mem_set_block_table(false);
+				return 1;
+			}
+			mem_set_block_table(false);
+		}
+	}
+
+	blocktable_set_scan(NULL);
+	return 0;
+}
+
+
+/* the bitmap strategy places whole granules first-fit and answers the status queries from bits */
+int test_bitmap(int argc, char **argv) {
+	void *blocks[64] = {NULL};
+	size_t sizes[64];
+	rng_t rng;
+	int i;
+
+	/* only runs for "all" or "bitmap", builds fixed to one strategy test just that one */
+	if (strategyFromString(*(argv+1)) > 0 && strategyFromString(*(argv+1)) != Bitmap)
+		return 0;
+
+	initmem(Bitmap,1000);
+	if (mem_total() != 992 || mymalloc(1) != mem_pool() || mymalloc(17) != mem_pool() + 16 || mymalloc(16) != mem_pool() + 48)
+	{
+		printf("Bitmap allocations not rounded to consecutive granules\n");
+		return 1;
+	}
+
+	if (mymalloc(SIZE_MAX) || mymalloc(993) || mem_allocated() != 64 || mem_check())
+	{
+		printf("Bitmap accepted a request larger than the pool\n");
+		return 1;
+	}
+
+	myfree(mem_pool() + 16);
+	if (mem_allocated() != 32 || mem_holes() != 2 || mem_is_alloc(mem_pool() + 16) != '0' || mem_is_alloc(mem_pool() + 48) != '1')
+	{
+		printf("Bitmap reports %d allocated in %d holes after a free\n", mem_allocated(), mem_holes());
+		return 1;
+	}
+	if (mymalloc(33) != mem_pool() + 64 || mymalloc(20) != mem_pool() + 16 || mem_largest_free() != 992 - 112 || mem_small_free(16) != 0)
+	{
+		printf("Bitmap first fit skipped or misplaced a hole\n");
+		return 1;
+	}
+
+	/* churn across word boundaries and make sure no two live blocks overlap */
+	rng_seed(&rng, 37);
+	initmem(Bitmap,1 << 14);
+	for (i = 0; i < 20000; i++)
+	{
+		int slot = rng_below(&rng, 64);
+		if (blocks[slot])
+		{
+			if (memchr(blocks[slot], 0, sizes[slot]) || memchr(blocks[slot], slot + 1, sizes[slot]) != blocks[slot])
+			{
+				printf("Bitmap block %d was overwritten\n", slot);
+				return 1;
+			}
+			myfree(blocks[slot]);
+			blocks[slot] = NULL;
+		}
+		else if ((blocks[slot] = mymalloc(sizes[slot] = 1 + rng_below(&rng, 700))))
+			memset(blocks[slot], slot + 1, sizes[slot]);
+
+		if (mem_check())
+			return 1;
+	}
+
+	mem_stats_t st;
+	mem_stats(&st);
+	if (st.holes != (size_t) mem_holes() || st.allocated_bytes != (size_t) mem_allocated() || st.largest_free != (size_t) mem_largest_free() ||
+	    st.free_bytes != (size_t) mem_free() ||
+	    st.fragmentation != (st.free_bytes ? 1.0 - (double) st.largest_free / st.free_bytes : 0))
+	{
+		printf("Bitmap statistics disagree with the status functions\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* kept out of line so it shows up as its own frame in the profile */
+__attribute__((noinline)) void profiled_allocation(void **blocks, int count)
+{
+	for (int i = 0; i < count; i++)
+		blocks[i] = mymalloc(64);
+}
+
+/* Read back a folded profile and return the value on the line naming profiled_allocation */
+static long profiled_value(mem_prof_kind kind)
+{
+	char line[4096];
+	long value = -1;
+	FILE *profile = tmpfile();
+
+	mem_prof_dump(fileno(profile), kind);
+	rewind(profile);
+	while (fgets(line, sizeof(line), profile))
+		if (strstr(line, "profiled_allocation"))
+			value = atol(strrchr(line, ' ') + 1);
+	fclose(profile);
+
+	return value;
+}
+
+/* with a tiny sampling interval every block is sampled and attributed to its call site */
+int test_profile(int argc, char **argv) {
+	strategies strategy = strategyFromString(*(argv+1)) > 0 ? strategyFromString(*(argv+1)) : First;
+	void *blocks[10];
+	long inuse, allocated;
+	int i;
+
+	initmem(strategy,4096);
+	mem_prof_enable(1);
+	profiled_allocation(blocks, 10);
+
+	inuse = profiled_value(ProfInuseBytes);
+	if (inuse != 640)
+	{
+		printf("Profile shows %ld bytes in use at the allocation site instead of 640\n", inuse);
+		mem_prof_enable(0);
+		return 1;
+	}
+
+	for (i = 0; i < 10; i++)
+		myfree(blocks[i]);
+	inuse = profiled_value(ProfInuseBytes);
+	allocated = profiled_value(ProfAllocBytes);
+	mem_prof_enable(0);
+
+	if (inuse != -1 || allocated != 640 || profiled_value(ProfLifetime) < 0)
+	{
+		printf("After freeing, the profile shows %ld bytes in use and %ld allocated\n", inuse, allocated);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* poll mem_stats for up to two seconds until the maintenance thread got to pass_count passes */
+static int wait_for_passes(unsigned long long pass_count, mem_stats_t *st)
+{
+	int waited;
+
+	for (waited = 0; waited < 200; waited++)
+	{
+		mem_stats(st);
+		if (st->maintenance_passes >= pass_count)
+			return 1;
+		usleep(10000);
+	}
+	return 0;
+}
+
+/* Wait up to two seconds for the maintenance thread to coalesce every parked free */
+static int wait_for_parked(void)
+{
+	int waited;
+
+	for (waited = 0; waited < 200; waited++)
+	{
+		if (!mem_parked_count())
+			return 1;
+		usleep(10000);
+	}
+	return 0;
+}
+
+/* the maintenance thread coalesces parked frees and gives the pages of a large hole back */
+int test_maintenance(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	void *blocks[256];
+	mem_stats_t st;
+	int i;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,1 << 20);
+		mem_set_deferred_coalescing(64);
+		mem_set_maintenance(5);
+
+		for (i = 0; i < 256; i++)
+			blocks[i] = mymalloc(4096);
+
+		/* 40 parked frees are past half the threshold, so the thread merges them on its own */
+		for (i = 0; i < 40; i++)
+			myfree(blocks[2*i+1]);
+		wait_for_parked();
+		mem_stats(&st);
+		if (st.background_frees != 40 || st.holes != 40 || mem_check())
+		{
+			printf("Thread coalesced %llu of 40 frees, %zu holes with %s\n", st.background_frees, st.holes, strategy_name(strategy));
+			mem_set_maintenance(0);
+			mem_set_deferred_coalescing(0);
+			return 1;
+		}
+
+		/* once everything is free, the next pass releases the whole pages of the one hole */
+		for (i = 0; i < 256; i++)
+			if (i >= 80 || i % 2 == 0)
+				myfree(blocks[i]);
+		if (!wait_for_passes(st.maintenance_passes + 2, &st) || st.trimmed_bytes < (1 << 20) - 2 * 4096 || mem_allocated() != 0 || mem_check())
+		{
+			printf("Thread trimmed %zu bytes in %llu passes with %s\n", st.trimmed_bytes, st.maintenance_passes, strategy_name(strategy));
+			mem_set_maintenance(0);
+			mem_set_deferred_coalescing(0);
+			return 1;
+		}
+
+		/* trimmed pages are fine to allocate again */
+		char *all = mymalloc(1 << 20);
+		if (!all || (memset(all, 1, 1 << 20), mem_largest_free() != 0))
+		{
+			printf("Trimmed pool could not be allocated again with %s\n", strategy_name(strategy));
+			mem_set_maintenance(0);
+			mem_set_deferred_coalescing(0);
+			return 1;
+		}
+		myfree(all);
+	}
+
+	/* initmem stops the thread before the pool goes away and starts it again for the new one */
+	initmem(lbound,1 << 16);
+	mymalloc(100);
+	mem_set_maintenance(0);
+	mem_set_deferred_coalescing(0);
+	if (mem_allocated() != 100 || mem_check())
+	{
+		printf("Pool broken after initmem with the thread running\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* a thread that waits for a block, or frees one once another thread waits for it */
+typedef struct
+{
+	size_t size;
+	int timeout_ms;
+	void *result;
+} waiter_args;
+
+static void *wait_thread(void *arg)
+{
+	waiter_args *args = arg;
+	args->result = mymalloc_wait(args->size, args->timeout_ms);
+	return NULL;
+}
+
+/* Wait up to two seconds for a number of mymalloc_wait calls to be queued */
+static int wait_for_waiters(size_t count)
+{
+	int waited;
+
+	for (waited = 0; waited < 200; waited++)
+	{
+		if (mem_waiting_count() >= count)
+			return 1;
+		usleep(10000);
+	}
+	return 0;
+}
+
+static void *delayed_free_thread(void *arg)
+{
+	wait_for_waiters(1);
+	myfree(arg);
+	return NULL;
+}
+
+/* mymalloc_wait times out, is woken by a free in another thread, and serves waiters FIFO */
+int test_wait(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	pthread_t first, second, freer;
+	waiter_args a, b;
+	void *held, *rest;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	mem_set_shared(true);
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,1024);
+		held = mymalloc(1024);
+
+		if (mymalloc_wait(512, 0) || mymalloc_wait(512, 20))
+		{
+			printf("Waiting allocation succeeded in a full pool with %s\n", strategy_name(strategy));
+			mem_set_shared(false);
+			return 1;
+		}
+
+		/* a free from another thread wakes the waiter well before its timeout */
+		pthread_create(&freer, NULL, delayed_free_thread, held);
+		held = mymalloc_wait(512, 5000);
+		pthread_join(freer, NULL);
+		if (held != mem_pool())
+		{
+			printf("Waiter got %p instead of the freed space with %s\n", held, strategy_name(strategy));
+			mem_set_shared(false);
+			return 1;
+		}
+
+		/* two waiters of the same class: the first to queue gets the first block */
+		myfree(held);
+		held = mymalloc(1024);
+		a.size = 300;
+		b.size = 260;
+		a.timeout_ms = b.timeout_ms = 5000;
+		pthread_create(&first, NULL, wait_thread, &a);
+		wait_for_waiters(1);
+		pthread_create(&second, NULL, wait_thread, &b);
+		wait_for_waiters(2);
+		myfree(held);
+		pthread_join(first, NULL);
+		pthread_join(second, NULL);
+		if (a.result != mem_pool() || !b.result || mem_allocated() < 560 || mem_check())
+		{
+			printf("Waiters were served out of order (%p, %p) with %s\n", a.result, b.result, strategy_name(strategy));
+			mem_set_shared(false);
+			return 1;
+		}
+
+		/* a smaller waiter of another class does not overtake an older large one */
+		initmem(strategy,1024);
+		/* whole bitmap granules, so the two blocks fill the pool with every strategy */
+		held = mymalloc(208);
+		rest = mymalloc(816);
+		a.size = 608;
+		b.size = 96;
+		a.timeout_ms = 5000;
+		b.timeout_ms = 200;
+		pthread_create(&first, NULL, wait_thread, &a);
+		wait_for_waiters(1);
+		pthread_create(&second, NULL, wait_thread, &b);
+		wait_for_waiters(2);
+		myfree(held);
+		pthread_join(second, NULL);
+		myfree(rest);
+		pthread_join(first, NULL);
+		if (b.result || a.result != mem_pool() || mem_allocated() != 608 || mem_check())
+		{
+			printf("Small waiter overtook the large one (%p, %p) with %s\n", a.result, b.result, strategy_name(strategy));
+			mem_set_shared(false);
+			return 1;
+		}
+	}
+	mem_set_shared(false);
+
+	return 0;
+}
+
+
+/* hinted blocks go to opposite ends of the pool, with the strategy still choosing the hole */
+int test_lifetime(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	void *low, *high;
+	int table;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	for (table = 0; table <= 1; table++)
+	{
+		initmem(strategy,1000);
+		mem_set_block_table(table);
+
+		low = mymalloc_hint(100, LifetimeLong);
+		high = mymalloc_hint(100, LifetimeShort);
+		if (low != mem_pool() || high != mem_pool() + 900 || mem_holes() != 1 || mem_check())
+		{
+			printf("Long-lived block at %ld, short-lived at %ld with %s\n", (long) (low - mem_pool()), (long) (high - mem_pool()), strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+
+		/* holes of 300 and 200 bytes below the short-lived block: the strategy picks one */
+		mymalloc_hint(100, LifetimeShort);
+		mymalloc_hint(200, LifetimeShort);
+		mymalloc_hint(100, LifetimeShort);
+		mymalloc_hint(100, LifetimeShort);
+		myfree(mem_pool() + 600);
+		high = mymalloc_hint(100, LifetimeShort);
+		if (high != mem_pool() + (strategy == First || strategy == Best ? 700 : 300) || mem_check())
+		{
+			printf("Short-lived block placed at %ld with %s\n", (long) (high - mem_pool()), strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+
+		/* with the size prediction, small requests without a hint count as short-lived */
+		initmem(strategy,1000);
+		mem_set_lifetime_prediction(50);
+		high = mymalloc(10);
+		low = mymalloc(60);
+		mem_set_lifetime_prediction(0);
+		mem_set_block_table(false);
+		if (high != mem_pool() + 990 || low != mem_pool())
+		{
+			printf("Predicted placement put 10 bytes at %ld and 60 at %ld with %s\n", (long) (high - mem_pool()), (long) (low - mem_pool()), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* interior pointers resolve to their block, and the answers follow splits and merges */
+int test_blockof(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	mem_block_info info;
+	void *a, *b, *c;
+	int table;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	for (table = 0; table <= 1; table++)
+	{
+		/* sizes are whole bitmap granules so every strategy sees the same layout */
+		mem_set_block_table(table);
+		initmem(strategy,1024);
+		a = mymalloc(96);
+		b = mymalloc(192);
+		c = mymalloc(96);
+		if (!mem_block_of(a + 50, &info) || info.start != a || info.size != 96 || !info.alloc)
+		{
+			printf("Interior pointer of the first block not resolved with %s\n", strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+
+		myfree(b);
+		if (!mem_block_of(b + 191, &info) || info.start != b || info.size != 192 || info.alloc)
+		{
+			printf("Freed block reported at %p, %zu bytes with %s\n", info.start, info.size, strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+
+		/* merging with the trailing hole, then splitting it again */
+		myfree(c);
+		if (!mem_block_of(mem_pool() + 1023, &info) || info.start != b || info.size != 928 || info.alloc)
+		{
+			printf("Merged hole reported at %p, %zu bytes with %s\n", info.start, info.size, strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+		if (mymalloc(48) != b || !mem_block_of(b + 20, &info) || info.start != b || info.size != 48 || !info.alloc ||
+		    !mem_block_of(b + 48, &info) || info.start != b + 48 || info.alloc || mem_check())
+		{
+			printf("Split block not resolved with %s\n", strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+
+		if (mem_block_of(mem_pool() + 1024, &info) || mem_block_of((char *) mem_pool() - 1, &info))
+		{
+			printf("Address outside the pool resolved with %s\n", strategy_name(strategy));
+			mem_set_block_table(false);
+			return 1;
+		}
+		mem_set_block_table(false);
+	}
+
+	return 0;
+}
+
+/* usable sizes follow the strategy's rounding and sized frees release blocks in any order */
+int test_sized(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	void *blocks[3000];
+	void *a;
+	int i;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,1024);
+		a = mymalloc(100);
+		if (mem_usable_size(a) != (strategy == Bitmap ? 112 : 100) || mem_usable_size(a + 16) || mem_usable_size(NULL))
+		{
+			printf("Usable size %zu for a 100 byte block with %s\n", mem_usable_size(a), strategy_name(strategy));
+			return 1;
+		}
+		/* a size ending inside the next block is refused rather than freeing part of it */
+		if (strategy == Bitmap)
+		{
+			mymalloc(16);
+			myfree_sized(a, 64);
+			if (mem_usable_size(a) != 112 || mem_allocated() != 128 || mem_check())
+			{
+				printf("Sized free with the wrong size cleared %d bytes with %s\n", 128 - mem_allocated(), strategy_name(strategy));
+				return 1;
+			}
+			initmem(strategy,1024);
+			a = mymalloc(100);
+		}
+		myfree_sized(a, 100);
+		if (mem_usable_size(a) || mem_allocated() || mem_check())
+		{
+			printf("Sized free left the block allocated with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* enough blocks to grow the address directory, freed in a scrambled order */
+		initmem(strategy,64000);
+		for (i = 0; i < 3000; i++)
+			blocks[i] = mymalloc(16);
+		for (i = 0; i < 3000; i++)
+		{
+			int j = (i * 1999) % 3000;
+			if (i % 2)
+				myfree_sized(blocks[j], 16);
+			else
+				myfree(blocks[j]);
+		}
+		if (mem_allocated() || mem_holes() != 1 || mem_check())
+		{
+			printf("%d bytes in %d holes left after freeing every block with %s\n", mem_allocated(), mem_holes(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* a 3 GiB pool reports exact byte counts while the int queries saturate */
+int test_large(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	size_t pool = (size_t) 3 << 30;
+	void *a, *b;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		/* the pool is never written, so only the bitmaps are paged in */
+		initmem(strategy,pool);
+		a = mymalloc(112);
+		b = mymalloc(16);
+		myfree(a);
+		if (mem_total_bytes() != pool || mem_allocated_bytes() != 16 || mem_free_bytes() != pool - 16 ||
+		    mem_largest_free_bytes() != pool - 128 || mem_holes_count() != 2 || mem_small_free_count(112) != 1)
+		{
+			printf("Wrong sizes for a 3 GiB pool with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		if (mem_total() != INT_MAX || mem_free() != INT_MAX || mem_largest_free() != INT_MAX || mem_allocated() != 16 ||
+		    mem_usable_size(b) != 16)
+		{
+			printf("int sizes did not saturate with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* a tail hole over 2 GiB larger than the request must not look like a closer fit */
+		if (strategy == Best && mymalloc(64) != a)
+		{
+			printf("Best fit skipped the 112 byte hole for the 3 GiB one\n");
+			return 1;
+		}
+
+		a = mymalloc(pool - 256);
+		if (!a || mem_allocated_bytes() < pool - 256 || mem_check())
+		{
+			printf("Could not allocate %zu bytes with %s\n", pool - 256, strategy_name(strategy));
+			return 1;
+		}
+		myfree(a);
+	}
+	initmem(First,1024);
+
+	return 0;
+}
+
+/* a lazily committed pool only commits the chunks its blocks reach */
+int test_commit(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	size_t chunk = (size_t) 2 << 20;
+	mem_stats_t stats;
+	char *a, *b, *c;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	mem_set_lazy_commit(true);
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,32 * chunk);
+		mem_stats(&stats);
+		if (stats.committed_bytes || stats.commit_high_water)
+		{
+			printf("%zu bytes committed by initmem with %s\n", stats.committed_bytes, strategy_name(strategy));
+			return 1;
+		}
+
+		/* every byte handed out must be writable */
+		a = mymalloc(96);
+		b = mymalloc(5 << 20);
+		memset(a, 1, 96);
+		memset(b, 2, 5 << 20);
+		mem_stats(&stats);
+		if (stats.committed_bytes != 3 * chunk || stats.commit_high_water != 3 * chunk)
+		{
+			printf("%zu bytes committed up to %zu for the first two blocks with %s\n", stats.committed_bytes, stats.commit_high_water, strategy_name(strategy));
+			return 1;
+		}
+
+		/* short-lived blocks come from the top, committing only the last chunk */
+		c = mymalloc_hint(96, LifetimeShort);
+		memset(c, 3, 96);
+		mem_stats(&stats);
+		if (strategy != Bitmap && (stats.committed_bytes != 4 * chunk || stats.commit_high_water != 32 * chunk))
+		{
+			printf("%zu bytes committed up to %zu for a high block with %s\n", stats.committed_bytes, stats.commit_high_water, strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(b);
+		b = mymalloc(96);
+		memset(b, 4, 96);
+		myfree(a);
+		myfree(b);
+		myfree(c);
+		if (mem_allocated() || mem_check())
+		{
+			printf("Reserved pool not empty again with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+	mem_set_lazy_commit(false);
+	initmem(First,1024);
+
+	return 0;
+}
+
+/* stack allocations bump in order, pop back to their marks and live in one heap block */
+int test_stack(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	size_t outer, inner;
+	char *heap, *a, *b, *c;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,4096);
+		heap = mymalloc(100);
+		if (!mem_stack_begin(1024) || mem_stack_begin(512))
+		{
+			printf("Stack not started exactly once with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		outer = mem_mark();
+		a = mymalloc(100);
+		b = mymalloc(50);
+		inner = mem_mark();
+		c = mymalloc(30);
+		myfree(c);
+		/* the stack block may start anywhere, the allocations on it are aligned like malloc's */
+		if ((uintptr_t) a % _Alignof(max_align_t) || b != a + 112 || c != b + 64 || outer != 0 ||
+		    mem_mark() - inner != 44 || mem_usable_size(a))
+		{
+			printf("Stack allocations not bumped in order with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		mem_release(inner);
+		if (mymalloc(30) != c || mymalloc(2000))
+		{
+			printf("Stack not popped to the inner mark with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		mem_release(outer);
+		if (mymalloc(10) != a)
+		{
+			printf("Stack not popped to the outer mark with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* the rest of the heap keeps working, and the stack is one allocated block in it */
+		myfree(heap);
+		if (mem_allocated() != 1024 || mem_check())
+		{
+			printf("%d bytes allocated around the stack with %s\n", mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+		mem_stack_end();
+		if (mem_allocated() || mem_check() || !mymalloc(4000))
+		{
+			printf("Stack block not freed by mem_stack_end with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* handles resolve to their block and go stale on free and on initmem */
+int test_handle(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Bitmap;
+	mem_handle a, b, handles[2000];
+	int i;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,1024);
+		a = mymalloc_handle(96);
+		if (!a || mem_handle_get(a) != mem_pool() || mem_handle_get(a + 1) || mem_handle_get(0))
+		{
+			printf("Handle not resolved with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* the slot is reused with a new generation, the old handle stays dead */
+		if (!myfree_handle(a) || myfree_handle(a) || mem_handle_get(a) || mem_allocated())
+		{
+			printf("Freed handle still valid with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		b = mymalloc_handle(96);
+		if (!b || b == a || mem_handle_get(b) != mem_pool() || myfree_handle(a) || mem_allocated() != 96)
+		{
+			printf("Stale handle freed its slot's new block with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		initmem(strategy,64000);
+		if (mem_handle_get(b) || myfree_handle(b))
+		{
+			printf("Handle survived initmem with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* enough handles to grow the slot table */
+		for (i = 0; i < 2000; i++)
+			handles[i] = mymalloc_handle(16);
+		for (i = 0; i < 2000; i++)
+			if (!myfree_handle(handles[(i * 7) % 2000]))
+			{
+				printf("Handle %d not freed with %s\n", (i * 7) % 2000, strategy_name(strategy));
+				return 1;
+			}
+		if (mem_allocated() || mem_check())
+		{
+			printf("%d bytes left after freeing every handle with %s\n", mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* small blocks are line aligned and coloured so that no two share a cache line */
+int test_colour(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = Next;
+	void *blocks[12];
+	mem_stats_t st;
+	int i, j;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+	if (lbound > Next)
+		return 0;
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		initmem(strategy,8192);
+		mem_set_line_colouring(64, 1);
+		blocks[0] = mymalloc(8);
+		blocks[1] = mymalloc(8);
+		blocks[2] = mymalloc(100);
+		if ((uintptr_t) blocks[0] % 64 || (uintptr_t) blocks[1] % 64 || mem_usable_size(blocks[0]) != 64 ||
+		    mem_usable_size(blocks[2]) != 100 || mem_check())
+		{
+			printf("Small blocks not line aligned with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		/* the bytes skipped to reach a line are cut off, not allocated and merged back */
+		mem_stats(&st);
+		if (st.merges || st.splits != st.blocks - 1)
+		{
+			printf("%llu splits and %llu merges for %zu blocks with %s\n", st.splits, st.merges, st.blocks, strategy_name(strategy));
+			return 1;
+		}
+		for (i = 0; i < 3; i++)
+			myfree(blocks[i]);
+
+		/* staggered colours, every block on lines of its own */
+		mem_set_line_colouring(64, 4);
+		for (i = 0; i < 12; i++)
+			blocks[i] = mymalloc(1 + i * 5);
+		for (i = 0; i < 12; i++)
+			for (j = 0; j < i; j++)
+				if ((uintptr_t) blocks[i] % 64 || (uintptr_t) blocks[i] / 64 == (uintptr_t) blocks[j] / 64)
+				{
+					printf("Coloured blocks %d and %d share a line with %s\n", i, j, strategy_name(strategy));
+					return 1;
+				}
+		/* coloured requests never reuse cached or parked blocks, so freeing them skips both */
+		mem_cache_configure(4, 4096);
+		mem_set_deferred_coalescing(64);
+		for (i = 0; i < 12; i++)
+			myfree_sized(blocks[i], 1 + i * 5);
+		mem_stats(&st);
+		if (st.cached_blocks || mem_parked_count())
+		{
+			printf("%zu coloured blocks cached, %zu parked with %s\n", st.cached_blocks, mem_parked_count(), strategy_name(strategy));
+			return 1;
+		}
+		mem_cache_configure(0, 0);
+		mem_set_deferred_coalescing(0);
+		if (mem_allocated() || mem_holes() != 1 || mem_check())
+		{
+			printf("Pool not whole again after coloured blocks with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+	mem_set_line_colouring(0, 1);
+
+	return 0;
+}
+
+
 int run_memory_tests(int argc, char **argv)
 {
 	if (argc < 3)
@@ -448,6 +1786,24 @@ int run_memory_tests(int argc, char **argv)
 		{"alloc2","suite2",test_alloc_2},
 		{"alloc3","suite1",test_alloc_3},
 		{"alloc4","suite2",test_alloc_4},
+		{"stats","suite2",test_stats},
+		{"dump","suite2",test_dump},
+		{"deferred","suite2",test_deferred},
+		{"cache","suite2",test_cache},
+		{"freelist","suite2",test_freelist},
+		{"blocktable","suite2",test_blocktable},
+		{"bitmap","suite2",test_bitmap},
+		{"profile","suite2",test_profile},
+		{"maintenance","suite2",test_maintenance},
+		{"wait","suite2",test_wait},
+		{"lifetime","suite2",test_lifetime},
+		{"blockof","suite2",test_blockof},
+		{"sized","suite2",test_sized},
+		{"large","suite2",test_large},
+		{"commit","suite2",test_commit},
+		{"stack","suite2",test_stack},
+		{"handle","suite2",test_handle},
+		{"colour","suite2",test_colour},
 		{"stress","suite3",do_stress_tests},
 	};
 
@@ -457,16 +1813,18 @@ int run_memory_tests(int argc, char **argv)
 int main(int argc, char **argv)
 {
   if( argc < 2) {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <test> <strategy> | mem -bench <benchmark> <strategy> | mem -try <arg1> <arg2> ... \n");
     exit(-1);
   }
   else if (!strcmp(argv[1],"-test"))
     return run_memory_tests(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-bench"))
+    return run_memory_benchmarks(argc-1,argv+1);
   else if (!strcmp(argv[1],"-try")) {
     try_mymem(argc-1,argv+1);
     return 0;
   } else {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <test> <strategy> | mem -bench <benchmark> <strategy> | mem -try <arg1> <arg2> ... \n");
     exit(-1);
   }
 
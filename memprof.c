@@ -0,0 +1,320 @@
+#include <execinfo.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "memprof.h"
+
+#define MEMPROF_MAX_DEPTH 32
+#define MEMPROF_SKIP_FRAMES 2       // memprof_sample and the mymalloc entry point
+
+int64_t memprof_bytes_until_sample = INT64_MAX;
+size_t memprof_live_samples;
+
+static size_t sample_bytes;         // mean sampling interval, 0 when off
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/* One allocation site: a distinct call stack and what its samples add up to */
+typedef struct
+{
+    uint64_t hash;
+    int depth;
+    void *stack[MEMPROF_MAX_DEPTH];
+    double alloc_bytes;             // estimates, every sample weighted by what it stands for
+    double inuse_bytes;
+    unsigned long long freed;       // sampled blocks freed, with their total lifetime
+    double lifetime_ns;
+} prof_site;
+
+/* A sampled block that is still allocated */
+typedef struct
+{
+    void *ptr;
+    double weight;
+    size_t site;
+    uint64_t born_ns;
+} live_sample;
+
+static prof_site *sites;
+static size_t site_count, site_capacity;
+static size_t *site_index;          // open addressing over sites, SIZE_MAX marks empty slots
+static size_t site_index_capacity;
+
+static live_sample *live;           // open addressing on ptr, NULL ptr marks empty slots
+static size_t live_capacity;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+
+/*
+ * Bytes until the next sample. Exponentially distributed with mean sample_bytes, so every byte
+ * allocated has the same chance of triggering a sample no matter how allocations are sized.
+ */
+static int64_t next_interval(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    double u = ((rng_state >> 11) + 1) * 0x1.0p-53;
+    double interval = -log(u) * sample_bytes;
+
+    return interval < 1 ? 1 : interval > INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t) interval;
+}
+
+/****** Site table ******/
+
+static void index_site(size_t site)
+{
+    size_t mask = site_index_capacity - 1;
+    size_t slot = sites[site].hash & mask;
+
+    while (site_index[slot] != SIZE_MAX)
+        slot = (slot + 1) & mask;
+    site_index[slot] = site;
+}
+
+static size_t find_site(void **stack, int depth)
+{
+    uint64_t hash = depth;
+    for (int i = 0; i < depth; i++)
+        hash = mix(hash ^ (uintptr_t) stack[i]);
+
+    if (site_index_capacity && site_index_capacity / 2 > site_count)
+    {
+        size_t mask = site_index_capacity - 1;
+        for (size_t slot = hash & mask; site_index[slot] != SIZE_MAX; slot = (slot + 1) & mask)
+        {
+            prof_site *site = &sites[site_index[slot]];
+            if (site->hash == hash && site->depth == depth && !memcmp(site->stack, stack, depth * sizeof(void *)))
+                return site_index[slot];
+        }
+    }
+    else
+    {
+        // Grow the index and re-insert every site, then look again
+        site_index_capacity = site_index_capacity ? site_index_capacity * 2 : 256;
+        site_index = realloc(site_index, site_index_capacity * sizeof(size_t));
+        memset(site_index, 0xff, site_index_capacity * sizeof(size_t));
+        for (size_t i = 0; i < site_count; i++)
+            index_site(i);
+        return find_site(stack, depth);
+    }
+
+    if (site_count == site_capacity)
+    {
+        site_capacity = site_capacity ? site_capacity * 2 : 64;
+        sites = realloc(sites, site_capacity * sizeof(prof_site));
+    }
+
+    prof_site *site = &sites[site_count];
+    memset(site, 0, sizeof(*site));
+    site->hash = hash;
+    site->depth = depth;
+    memcpy(site->stack, stack, depth * sizeof(void *));
+    index_site(site_count);
+    return site_count++;
+}
+
+/****** Live samples ******/
+
+static void live_insert(live_sample sample);
+
+static void live_grow(void)
+{
+    live_sample *old = live;
+    size_t old_capacity = live_capacity;
+
+    live_capacity = live_capacity ? live_capacity * 2 : 256;
+    live = calloc(live_capacity, sizeof(live_sample));
+    memprof_live_samples = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].ptr)
+            live_insert(old[i]);
+    free(old);
+}
+
+static void live_insert(live_sample sample)
+{
+    if ((memprof_live_samples + 1) * 2 > live_capacity)
+        live_grow();
+
+    size_t mask = live_capacity - 1;
+    size_t slot = mix((uintptr_t) sample.ptr) & mask;
+    while (live[slot].ptr)
+        slot = (slot + 1) & mask;
+
+    live[slot] = sample;
+    memprof_live_samples++;
+}
+
+/**
+ * Records a sample for a block mymalloc just returned and schedules the next one. Called by
+ * memprof_on_alloc once the byte countdown runs out.
+ * @param ptr the new block
+ * @param size requested bytes
+ */
+void memprof_sample(void *ptr, size_t size)
+{
+    void *stack[MEMPROF_MAX_DEPTH + MEMPROF_SKIP_FRAMES];
+
+    if (!sample_bytes)
+    {
+        memprof_bytes_until_sample = INT64_MAX;
+        return;
+    }
+    memprof_bytes_until_sample = next_interval();
+
+    int depth = backtrace(stack, MEMPROF_MAX_DEPTH + MEMPROF_SKIP_FRAMES) - MEMPROF_SKIP_FRAMES;
+    if (depth < 0)
+        depth = 0;
+
+    // A block of size s is sampled with probability 1 - e^(-s/R), so it stands for s / p bytes
+    double weight = size / -expm1(-(double) size / sample_bytes);
+    size_t site = find_site(stack + MEMPROF_SKIP_FRAMES, depth);
+    sites[site].alloc_bytes += weight;
+    sites[site].inuse_bytes += weight;
+
+    live_sample sample = {ptr, weight, site, now_ns()};
+    live_insert(sample);
+}
+
+/* Drop the sample for a block being freed, if it has one, and record its lifetime */
+void memprof_forget(void *ptr)
+{
+    size_t mask = live_capacity - 1;
+    size_t slot = mix((uintptr_t) ptr) & mask;
+
+    while (live[slot].ptr != ptr)
+    {
+        if (!live[slot].ptr)
+            return;
+        slot = (slot + 1) & mask;
+    }
+
+    prof_site *site = &sites[live[slot].site];
+    site->inuse_bytes -= live[slot].weight;
+    site->freed++;
+    site->lifetime_ns += now_ns() - live[slot].born_ns;
+    memprof_live_samples--;
+
+    // Backward shift deletion keeps every probe sequence intact without tombstones
+    for (size_t next = (slot + 1) & mask; live[next].ptr; next = (next + 1) & mask)
+    {
+        size_t home = mix((uintptr_t) live[next].ptr) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            live[slot] = live[next];
+            slot = next;
+        }
+    }
+    live[slot].ptr = NULL;
+}
+
+/* initmem discards the pool, so every sampled block is gone without a free */
+void memprof_pool_reset(void)
+{
+    for (size_t i = 0; i < site_count; i++)
+        sites[i].inuse_bytes = 0;
+    if (live)
+        memset(live, 0, live_capacity * sizeof(live_sample));
+    memprof_live_samples = 0;
+}
+
+/**
+ * Starts sampling with a fresh profile, or stops it. Stopping keeps the profile and still
+ * tracks frees of the blocks sampled so far, so it can be dumped afterwards.
+ * @param mean_bytes mean number of bytes allocated between samples, 0 to stop
+ */
+void mem_prof_enable(size_t mean_bytes)
+{
+    memprof_pool_lock();
+    sample_bytes = mean_bytes;
+    if (!mean_bytes)
+    {
+        memprof_bytes_until_sample = INT64_MAX;
+        memprof_pool_unlock();
+        return;
+    }
+
+    site_count = 0;
+    if (site_index)
+        memset(site_index, 0xff, site_index_capacity * sizeof(size_t));
+    memprof_pool_reset();
+
+    // The first backtrace loads the unwinder, keep that out of the first sample
+    void *warm[2];
+    backtrace(warm, 2);
+    memprof_bytes_until_sample = next_interval();
+    memprof_pool_unlock();
+}
+
+/* Function name of a frame from backtrace_symbols, "module(name+0x1f) [0x...]" on glibc */
+static void write_frame(int fd, char *symbol, void *address)
+{
+    char *open = strchr(symbol, '(');
+    char *end = open ? strpbrk(open, "+)") : NULL;
+
+    if (open && end && end > open + 1)
+        dprintf(fd, "%.*s", (int) (end - open - 1), open + 1);
+    else
+        dprintf(fd, "%p", address);
+}
+
+/**
+ * Writes the profile in folded-stack format, one "root;...;leaf value" line per allocation
+ * site, as read by flamegraph.pl and speedscope (and by pprof after conversion)
+ * @param fd file descriptor opened for writing
+ * @param kind which value to report per site
+ * @return number of sites written, -1 if sampling was never enabled
+ */
+int mem_prof_dump(int fd, mem_prof_kind kind)
+{
+    int written = 0;
+
+    memprof_pool_lock();
+    if (!sites && !sample_bytes)
+    {
+        memprof_pool_unlock();
+        return -1;
+    }
+
+    for (size_t i = 0; i < site_count; i++)
+    {
+        prof_site *site = &sites[i];
+        double value = kind == ProfInuseBytes ? site->inuse_bytes :
+                       kind == ProfAllocBytes ? site->alloc_bytes :
+                       site->freed ? site->lifetime_ns / site->freed / 1000 : 0;
+        if (value < 0.5)
+            continue;
+
+        char **symbols = backtrace_symbols(site->stack, site->depth);
+        for (int frame = site->depth - 1; frame >= 0; frame--)
+        {
+            if (symbols)
+                write_frame(fd, symbols[frame], site->stack[frame]);
+            else
+                dprintf(fd, "%p", site->stack[frame]);
+            if (frame)
+                dprintf(fd, ";");
+        }
+        dprintf(fd, "%s%.0f\n", site->depth ? " " : "[unknown] ", value);
+        free(symbols);
+        written++;
+    }
+
+    memprof_pool_unlock();
+    return written;
+}
@@ -0,0 +1,34 @@
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stdint.h>
+
+#include "mymem.h"
+
+/*
+ * Sampling heap profiler, see mem_prof_enable. The hooks below are all the allocation path
+ * pays: one subtraction and compare per allocation, and one load per free while any sampled
+ * block is alive. Everything else happens in memprof.c once per sample.
+ */
+extern int64_t memprof_bytes_until_sample;     // INT64_MAX while sampling is off
+extern size_t memprof_live_samples;
+
+void memprof_sample(void *, size_t);
+void memprof_forget(void *);
+void memprof_pool_reset(void);
+void memprof_pool_lock(void);
+void memprof_pool_unlock(void);
+
+static inline void memprof_on_alloc(void *ptr, size_t size)
+{
+    if ((memprof_bytes_until_sample -= (int64_t) size) < 0)
+        memprof_sample(ptr, size);
+}
+
+static inline void memprof_on_free(void *ptr)
+{
+    if (memprof_live_samples)
+        memprof_forget(ptr);
+}
+
+#endif
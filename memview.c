@@ -0,0 +1,211 @@
+/*
+ * memview: render a heap snapshot written by mem_dump.
+ *
+ *   memview [-w width] [-r rows] <dump file | ->
+ *
+ * Prints a summary, an occupancy map of the pool (each cell shows how much of its byte range is
+ * allocated) and log2 histograms of hole and allocated block sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memdump.h"
+
+#define SIZE_BUCKETS 48
+
+typedef struct
+{
+    FILE *in;
+    long offset;
+} reader;
+
+static int read_varint(reader *r, uint64_t *value)
+{
+    int c, shift = 0;
+    *value = 0;
+
+    do
+    {
+        if ((c = getc(r->in)) == EOF || shift > 63)
+            return -1;
+        *value |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+        r->offset++;
+    }
+    while (c & 0x80);
+
+    return 0;
+}
+
+static int size_bucket(uint64_t size)
+{
+    int bucket = size ? 63 - __builtin_clzll(size) : 0;
+    return bucket < SIZE_BUCKETS ? bucket : SIZE_BUCKETS - 1;
+}
+
+static void print_histogram(char *title, const uint64_t *counts)
+{
+    uint64_t max = 0;
+    int first = -1, last = -1;
+
+    for (int i = 0; i < SIZE_BUCKETS; i++)
+    {
+        if (counts[i] > max)
+            max = counts[i];
+        if (counts[i])
+        {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+
+    printf("\n%s\n", title);
+    if (first < 0)
+    {
+        printf("  (none)\n");
+        return;
+    }
+
+    for (int i = first; i <= last; i++)
+    {
+        int width = (int) (counts[i] * 50 / max);
+        printf("  %12llu - %-12llu %10llu ", 1ull << i, (2ull << i) - 1, (unsigned long long) counts[i]);
+        for (int j = 0; j < width; j++)
+            putchar('#');
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const char shades[] = " .:-=+*%#@";
+    unsigned char header[MEMDUMP_HEADER_SIZE];
+    uint64_t hole_counts[SIZE_BUCKETS] = {0};
+    uint64_t alloc_counts[SIZE_BUCKETS] = {0};
+    int width = 64, rows = 16;
+    char *path = NULL;
+    reader r = {NULL, 0};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            rows = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+
+    if (!path || width < 1 || rows < 1)
+    {
+        fprintf(stderr, "Usage: memview [-w width] [-r rows] <dump file | ->\n");
+        return 1;
+    }
+
+    r.in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!r.in)
+    {
+        perror(path);
+        return 1;
+    }
+
+    if (fread(header, 1, sizeof(header), r.in) != sizeof(header) || memcmp(header, MEMDUMP_MAGIC, 8))
+    {
+        fprintf(stderr, "%s: not a heap snapshot\n", path);
+        return 1;
+    }
+    if (memdump_get_u32(header + 8) != MEMDUMP_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported snapshot version %u\n", path, memdump_get_u32(header + 8));
+        return 1;
+    }
+    r.offset = sizeof(header);
+
+    static const char *strategy_names[] = {"unknown", "best", "worst", "first", "next", "bitmap"};
+    uint32_t strategy = memdump_get_u32(header + 12);
+    uint64_t pool_size = memdump_get_u64(header + 16);
+    uint64_t block_count = memdump_get_u64(header + 24);
+    uint64_t allocated = memdump_get_u64(header + 32);
+
+    size_t cells = (size_t) width * rows;
+    uint64_t *cell_alloc = calloc(cells, sizeof(uint64_t));
+    uint64_t cell_bytes = pool_size / cells + (pool_size % cells != 0);
+    if (!cell_bytes)
+        cell_bytes = 1;
+
+    uint64_t offset = 0, holes = 0, largest_hole = 0, seen_alloc = 0, gaps = 0;
+    for (uint64_t b = 0; b < block_count; b++)
+    {
+        uint64_t gap, word;
+        if (read_varint(&r, &gap) || read_varint(&r, &word))
+        {
+            fprintf(stderr, "%s: truncated after %llu of %llu records\n", path,
+                    (unsigned long long) b, (unsigned long long) block_count);
+            return 1;
+        }
+
+        uint64_t size = word >> 1;
+        int alloc = word & 1;
+        gaps += gap != 0;
+        offset += gap;
+
+        if (alloc)
+        {
+            alloc_counts[size_bucket(size)]++;
+            seen_alloc += size;
+
+            // Spread the block over the cells it covers
+            for (uint64_t pos = offset; pos < offset + size && pos < pool_size;)
+            {
+                uint64_t cell = pos / cell_bytes;
+                uint64_t cell_end = (cell + 1) * cell_bytes;
+                uint64_t end = offset + size < cell_end ? offset + size : cell_end;
+                cell_alloc[cell] += end - pos;
+                pos = end;
+            }
+        }
+        else
+        {
+            hole_counts[size_bucket(size)]++;
+            holes++;
+            if (size > largest_hole)
+                largest_hole = size;
+        }
+        offset += size;
+    }
+
+    printf("Heap snapshot %s\n", path);
+    printf("  strategy %s, pool %llu bytes, %llu blocks, %llu holes\n",
+           strategy < 6 ? strategy_names[strategy] : "unknown", (unsigned long long) pool_size,
+           (unsigned long long) block_count, (unsigned long long) holes);
+    printf("  %llu bytes allocated, %llu free, largest hole %llu bytes, fragmentation %.3f\n",
+           (unsigned long long) allocated, (unsigned long long) (pool_size - allocated),
+           (unsigned long long) largest_hole,
+           pool_size > allocated ? 1.0 - (double) largest_hole / (pool_size - allocated) : 0.0);
+    if (seen_alloc != allocated || offset != pool_size || gaps)
+        printf("  warning: records cover %llu bytes with %llu allocated and %llu gaps\n",
+               (unsigned long long) offset, (unsigned long long) seen_alloc, (unsigned long long) gaps);
+
+    printf("\nOccupancy map, %llu bytes per cell (' ' empty ... '@' full)\n", (unsigned long long) cell_bytes);
+    for (int row = 0; row < rows; row++)
+    {
+        printf("  |");
+        for (int col = 0; col < width; col++)
+        {
+            size_t cell = (size_t) row * width + col;
+            uint64_t start = cell * cell_bytes;
+            uint64_t span = start >= pool_size ? 0 : pool_size - start < cell_bytes ? pool_size - start : cell_bytes;
+            int shade = span ? (int) ((cell_alloc[cell] * (sizeof(shades) - 2) + span - 1) / span) : 0;
+            putchar(shades[shade]);
+        }
+        printf("|\n");
+    }
+
+    print_histogram("Hole sizes (bytes)", hole_counts);
+    print_histogram("Allocated block sizes (bytes)", alloc_counts);
+
+    free(cell_alloc);
+    return 0;
+}
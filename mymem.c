@@ -1,4 +1,15 @@
 #include "mymem.h"
+#include "meminstr.h"
+#include "memdump.h"
+#include "blocktable.h"
+#include "bitmap.h"
+#include "memprof.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 strategies myStrategy = NotSet;    // Current strategy
 
@@ -6,7 +17,1150 @@ size_t mySize;
 void *myMemory = NULL;
 
 static memoryList *head;
-static memoryList *last_allocated;
+
+/*
+ * While the maintenance thread runs (see mem_set_maintenance) or the pool is shared between
+ * threads (see mem_set_shared), every public entry point holds pool_lock. It is recursive since
+ * status functions call each other, and it is not taken at all otherwise, so a plain
+ * single-threaded pool pays one predictable branch.
+ */
+static bool maintenance_running;
+static bool shared_pool;
+static bool use_pool_lock;
+static pthread_mutex_t pool_lock;
+static pthread_once_t pool_lock_once = PTHREAD_ONCE_INIT;
+static pthread_condattr_t monotonic_cond;   // for condition variables with CLOCK_MONOTONIC deadlines
+static memoryList *trim_cursor;     // next hole the maintenance thread's trim pass looks at
+
+#define POOL_LOCK() do { if (use_pool_lock) pthread_mutex_lock(&pool_lock); } while (0)
+#define POOL_UNLOCK() do { if (use_pool_lock) pthread_mutex_unlock(&pool_lock); } while (0)
+
+static void pool_lock_init(void)
+{
+    pthread_mutexattr_t mutex_attr;
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pool_lock, &mutex_attr);
+    pthread_condattr_init(&monotonic_cond);
+    pthread_condattr_setclock(&monotonic_cond, CLOCK_MONOTONIC);
+}
+
+/* POOL_LOCK and POOL_UNLOCK for the public entry points of memprof.c */
+void memprof_pool_lock(void)
+{
+    POOL_LOCK();
+}
+
+void memprof_pool_unlock(void)
+{
+    POOL_UNLOCK();
+}
+
+/*
+ * Counters behind mem_stats and the cheap status functions. They are updated on every split,
+ * merge and state change, so none of them needs a walk of the memory list. The largest hole
+ * is cached and only recomputed when a hole of exactly that size shrinks or disappears, from the
+ * holes of the highest non-empty histogram bucket, which are linked together for that.
+ */
+static mem_stats_t stats;
+static bool largest_free_valid;
+static memoryList *hole_buckets[MEM_HOLE_BUCKETS];
+
+static int hole_bucket(size_t size)
+{
+    int bucket = size ? 63 - __builtin_clzll(size) : 0;
+    return bucket < MEM_HOLE_BUCKETS ? bucket : MEM_HOLE_BUCKETS - 1;
+}
+
+static void hole_added(memoryList *hole)
+{
+    int bucket = hole_bucket(hole->size);
+    stats.holes++;
+    stats.hole_histogram[bucket]++;
+    hole->bprev = NULL;
+    hole->bnext = hole_buckets[bucket];
+    if (hole->bnext)
+        hole->bnext->bprev = hole;
+    hole_buckets[bucket] = hole;
+    if (largest_free_valid && hole->size > stats.largest_free)
+        stats.largest_free = hole->size;
+}
+
+/* Called before the hole's size changes, while it still names the hole's bucket */
+static void hole_removed(memoryList *hole)
+{
+    int bucket = hole_bucket(hole->size);
+    stats.holes--;
+    stats.hole_histogram[bucket]--;
+    if (hole->bprev)
+        hole->bprev->bnext = hole->bnext;
+    else
+        hole_buckets[bucket] = hole->bnext;
+    if (hole->bnext)
+        hole->bnext->bprev = hole->bprev;
+    if (hole->size == stats.largest_free)
+        largest_free_valid = false;
+}
+
+/*
+ * Every hole is also linked into an address-ordered circular list starting at free_head, so
+ * next-fit and the hole scans never visit allocated blocks. The rover is where the next next-fit
+ * search starts: the first hole ending after the end of the last allocation, wrapping around
+ * to free_head.
+ */
+static memoryList *free_head;
+static memoryList *rover;
+static size_t rover_offset;     // offset in myMemory right after the last allocation
+static memoryList *short_rover; // where next-fit for short-lived blocks carries on downwards
+
+/* Distance from the end of the last allocation to the end of a hole, going around the pool */
+static size_t rover_distance(memoryList *block)
+{
+    size_t end = (char *) block->ptr + block->size - (char *) myMemory;
+    return end > rover_offset ? end - rover_offset : end + mySize - rover_offset;
+}
+
+/* Link a hole into the free list right before next, or as the only hole when next is NULL */
+static void free_list_link(memoryList *block, memoryList *next)
+{
+    if (!next)
+    {
+        block->fnext = block->fprev = block;
+        free_head = rover = short_rover = block;
+        return;
+    }
+
+    block->fnext = next;
+    block->fprev = next->fprev;
+    next->fprev->fnext = block;
+    next->fprev = block;
+    if (next == free_head && block->ptr < next->ptr)
+        free_head = block;
+    if (rover_distance(block) < rover_distance(rover))
+        rover = block;
+}
+
+/* Insert a new hole, finding its place from the nearest hole on either side in the memory list */
+static void free_list_insert(memoryList *block)
+{
+    memoryList *left = block->prev;
+    memoryList *right = block->next;
+
+    while (left || right)
+    {
+        if (right && !right->alloc)
+        {
+            free_list_link(block, right);
+            return;
+        }
+        if (left && !left->alloc)
+        {
+            free_list_link(block, left->fnext);
+            return;
+        }
+        left = left ? left->prev : NULL;
+        right = right ? right->next : NULL;
+    }
+
+    free_list_link(block, NULL);
+}
+
+static void free_list_remove(memoryList *block)
+{
+    if (block->fnext == block)
+    {
+        free_head = rover = short_rover = trim_cursor = NULL;
+        return;
+    }
+
+    if (short_rover == block)
+        short_rover = block->fprev;
+    if (trim_cursor == block)
+        trim_cursor = block->fnext != free_head ? block->fnext : NULL;
+    block->fprev->fnext = block->fnext;
+    block->fnext->fprev = block->fprev;
+    if (free_head == block)
+        free_head = block->fnext;
+    if (rover == block)
+        rover = block->fnext;
+}
+
+/* Put block in the free list position of hole, which is about to be merged into it */
+static void free_list_replace(memoryList *hole, memoryList *block)
+{
+    if (hole->fnext == hole)
+        block->fnext = block->fprev = block;
+    else
+    {
+        block->fnext = hole->fnext;
+        block->fprev = hole->fprev;
+        hole->fprev->fnext = block;
+        hole->fnext->fprev = block;
+    }
+    if (free_head == hole)
+        free_head = block;
+    if (rover == hole)
+        rover = block;
+    if (short_rover == hole)
+        short_rover = block;
+    if (trim_cursor == hole)
+        trim_cursor = block;
+}
+
+/*
+ * Reserved pools, see mem_set_lazy_commit. The pool is mapped PROT_NONE and made accessible one
+ * COMMIT_CHUNK at a time, the first time an allocation reaches into a chunk. A chunk stays
+ * committed until initmem unmaps the pool; the trim pass still hands its free pages back.
+ */
+#define COMMIT_CHUNK ((size_t) 2 << 20)
+
+static bool lazy_commit;
+static size_t mapped_size;              // length of the mapping, 0 for a malloc'd pool
+static uint64_t *committed_chunks;      // one bit per chunk, NULL unless the pool is reserved
+
+/* Reserve the address space for a pool, falling back to malloc when that is off or fails */
+static void *pool_create(size_t size)
+{
+    void *pool = MAP_FAILED;
+
+    if (lazy_commit && size)
+        pool = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED)
+        return malloc(size);
+
+    // Without the chunk bits every chunk would look committed and stay PROT_NONE
+    committed_chunks = calloc((size / COMMIT_CHUNK + 64) / 64, sizeof(uint64_t));
+    if (!committed_chunks)
+    {
+        munmap(pool, size);
+        return malloc(size);
+    }
+
+    mapped_size = size;
+    return pool;
+}
+
+static void pool_destroy(void *pool)
+{
+    if (mapped_size)
+        munmap(pool, mapped_size);
+    else
+        free(pool);
+    free(committed_chunks);
+    committed_chunks = NULL;
+    mapped_size = 0;
+}
+
+static bool chunk_committed(size_t chunk)
+{
+    return committed_chunks[chunk / 64] >> (chunk % 64) & 1;
+}
+
+/* Commit every chunk a new block overlaps that is still PROT_NONE */
+static __attribute__((noinline)) bool commit_chunks(size_t first, size_t last)
+{
+    for (size_t chunk = first; chunk <= last; chunk++)
+    {
+        if (chunk_committed(chunk))
+            continue;
+
+        size_t start = chunk * COMMIT_CHUNK;
+        size_t length = mapped_size - start < COMMIT_CHUNK ? mapped_size - start : COMMIT_CHUNK;
+        if (mprotect((char *) myMemory + start, length, PROT_READ | PROT_WRITE))
+            return false;
+
+        committed_chunks[chunk / 64] |= 1ull << (chunk % 64);
+        stats.committed_bytes += length;
+        if (start + length > stats.commit_high_water)
+            stats.commit_high_water = start + length;
+    }
+
+    return true;
+}
+
+/**
+ * Makes a freshly carved block accessible. Recycled blocks were committed when first carved.
+ * @return false if the kernel refused to commit the memory
+ */
+static inline bool commit(void *ptr, size_t size)
+{
+    if (!committed_chunks)
+        return true;
+
+    size_t offset = (char *) ptr - (char *) myMemory;
+    size_t first = offset / COMMIT_CHUNK, last = (offset + (size ? size : 1) - 1) / COMMIT_CHUNK;
+    if (chunk_committed(first) && chunk_committed(last) && last - first < 2)
+        return true;
+    return commit_chunks(first, last);
+}
+
+/*
+ * Stack mode, see mem_stack_begin. One allocated block of the heap backs the stack, and while
+ * it is active every allocation is a bump of stack_top inside it, padded up to STACK_ALIGN
+ * like malloc's blocks so LIFO callers can put any type there.
+ */
+#define STACK_ALIGN _Alignof(max_align_t)
+
+static char *stack_base;        // NULL unless the stack mode is on
+static size_t stack_size;
+static size_t stack_top;        // bytes handed out, the mark of the next allocation
+
+static inline bool in_stack(void *ptr)
+{
+    return stack_base && (char *) ptr >= stack_base && (char *) ptr < stack_base + stack_size;
+}
+
+static inline void *stack_alloc(size_t requested)
+{
+    // The heap block under the stack need not be aligned, so the padding is from the address
+    size_t pad = -(uintptr_t) (stack_base + stack_top) & (STACK_ALIGN - 1);
+    if (pad > stack_size - stack_top || requested > stack_size - stack_top - pad)
+    {
+        stats.failed_allocations++;
+        return NULL;
+    }
+
+    void *ptr = stack_base + stack_top + pad;
+    stack_top += pad + requested;
+    return ptr;
+}
+
+/*
+ * Handle slots, see mymalloc_handle. A handle is the slot index in the low 32 bits and the
+ * slot's generation in the high ones. Freeing a slot bumps its generation, so every handle
+ * issued for it before goes stale, and generation 0 is skipped so no valid handle is 0.
+ */
+typedef struct handle_slot
+{
+    void *ptr;                  // NULL while the slot is free
+    memoryList *block;          // the block's node, NULL for the Bitmap strategy
+    uint32_t generation;
+    uint32_t next_free;
+} handle_slot;
+
+#define NO_SLOT UINT32_MAX
+
+static handle_slot *handle_slots;
+static uint32_t handle_capacity;
+static uint32_t handle_free = NO_SLOT;
+
+static void handle_retire(uint32_t index)
+{
+    handle_slot *slot = &handle_slots[index];
+    slot->ptr = NULL;
+    slot->block = NULL;
+    if (!++slot->generation)
+        slot->generation = 1;
+    slot->next_free = handle_free;
+    handle_free = index;
+}
+
+/* initmem discards every block, and with them every handle issued so far */
+static void handles_reset(void)
+{
+    for (uint32_t i = 0; i < handle_capacity; i++)
+        if (handle_slots[i].ptr)
+            handle_retire(i);
+}
+
+/* Double the slot table, false if out of memory or if the indexes would no longer fit 32 bits */
+static bool handles_grow(void)
+{
+    size_t capacity = handle_capacity ? (size_t) handle_capacity * 2 : 1024;
+    if (capacity > NO_SLOT || capacity > SIZE_MAX / sizeof(handle_slot))
+        return false;
+
+    handle_slot *grown = realloc(handle_slots, capacity * sizeof(handle_slot));
+    if (!grown)
+        return false;
+
+    handle_slots = grown;
+    for (size_t i = capacity; i-- > handle_capacity; )
+    {
+        handle_slots[i] = (handle_slot) {NULL, NULL, 1, handle_free};
+        handle_free = (uint32_t) i;
+    }
+    handle_capacity = (uint32_t) capacity;
+    return true;
+}
+
+/* The slot a handle names, NULL if the handle is stale or was never issued */
+static inline handle_slot *handle_resolve(mem_handle handle)
+{
+    uint32_t index = (uint32_t) handle;
+    if (index >= handle_capacity)
+        return NULL;
+
+    handle_slot *slot = &handle_slots[index];
+    return slot->generation == handle >> 32 && slot->ptr ? slot : NULL;
+}
+
+/*
+ * Directory of the allocated blocks keyed by address, so myfree finds a block in O(1) instead of
+ * walking the memory list. Open addressing with linear probing, kept at most half full, with
+ * backward shift deletion so no tombstones build up. Parked and cached blocks count as
+ * allocated and stay in it.
+ */
+static memoryList **directory;
+static size_t directory_capacity;       // a power of two, or 0 before the first allocation
+static size_t directory_count;
+static int directory_shift;             // 64 - log2(directory_capacity)
+
+static inline size_t directory_home(void *ptr)
+{
+    return ((uintptr_t) ptr * 0x9e3779b97f4a7c15ull) >> directory_shift;
+}
+
+static void directory_insert(memoryList *block);
+
+static void directory_grow(void)
+{
+    memoryList **old = directory;
+    size_t old_capacity = directory_capacity;
+
+    directory_capacity = directory_capacity ? directory_capacity * 2 : 1024;
+    directory_shift = 64 - __builtin_ctzll(directory_capacity);
+    directory = calloc(directory_capacity, sizeof(memoryList *));
+    directory_count = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i])
+            directory_insert(old[i]);
+    free(old);
+}
+
+static void directory_insert(memoryList *block)
+{
+    if ((directory_count + 1) * 2 > directory_capacity)
+        directory_grow();
+
+    size_t mask = directory_capacity - 1;
+    size_t slot = directory_home(block->ptr);
+    while (directory[slot])
+        slot = (slot + 1) & mask;
+
+    directory[slot] = block;
+    directory_count++;
+}
+
+/* The allocated block starting at ptr, NULL if there is none */
+static inline memoryList *directory_lookup(void *ptr)
+{
+    INSTR_DECLARE(probes);
+
+    if (!directory_count)
+        return NULL;
+
+    size_t mask = directory_capacity - 1;
+    memoryList *found;
+    for (size_t slot = directory_home(ptr); (found = directory[slot]) && found->ptr != ptr; slot = (slot + 1) & mask)
+        INSTR_STEP(probes);
+
+    INSTR_SEARCH(find_block, probes);
+    return found;
+}
+
+static void directory_remove(memoryList *block)
+{
+    size_t mask = directory_capacity - 1;
+    size_t slot = directory_home(block->ptr);
+
+    while (directory[slot] != block)
+        slot = (slot + 1) & mask;
+    directory_count--;
+
+    for (size_t next = (slot + 1) & mask; directory[next]; next = (next + 1) & mask)
+    {
+        size_t home = directory_home(directory[next]->ptr);
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            directory[slot] = directory[next];
+            slot = next;
+        }
+    }
+    directory[slot] = NULL;
+}
+
+/*
+ * Deferred coalescing. When enabled, myfree only parks the block on a LIFO quick list and leaves
+ * it marked allocated, so neither the counters nor the list change. An allocation of exactly the
+ * same size takes a parked block back for free; everything else coalesces the whole list first.
+ */
+static size_t deferred_threshold;
+static size_t deferred_count;
+static memoryList *deferred_head;
+
+static void free_block(memoryList *);
+
+static void *allocate_block(memoryList *, size_t);
+static memoryList *first_fit(size_t);
+static memoryList *worst_fit(size_t);
+static memoryList *best_fit(size_t);
+static memoryList *next_fit(size_t);
+static memoryList *high_fit(strategies, size_t);
+static void *allocate_high(memoryList *, size_t);
+static size_t refresh_largest_free(void);
+static size_t largest_free_now(void);
+static void wake_waiters(void);
+
+/* Run the real free, with merging, for up to limit parked blocks, most recently parked first */
+static size_t coalesce_parked(size_t limit)
+{
+    size_t coalesced = 0;
+
+    if (!deferred_head)
+        return 0;
+
+    while (deferred_head && coalesced < limit)
+    {
+        memoryList *block = deferred_head;
+        deferred_head = block->qnext;
+        block->qnext = NULL;
+        block->deferred = false;
+        // The other parked blocks still look allocated, so this merge never frees one of them
+        free_block(block);
+        coalesced++;
+    }
+
+    deferred_count -= coalesced;
+    if (!deferred_head)
+        stats.coalesce_batches++;
+    return coalesced;
+}
+
+/* Run the real free, with merging, for every parked block */
+static void coalesce_deferred(void)
+{
+    coalesce_parked(SIZE_MAX);
+}
+
+/* Take a parked block of exactly the requested size off the quick list, if there is one */
+static memoryList *take_deferred(size_t requested)
+{
+    for (memoryList **link = &deferred_head; *link; link = &(*link)->qnext)
+    {
+        memoryList *block = *link;
+        if (block->size == requested)
+        {
+            *link = block->qnext;
+            block->qnext = NULL;
+            block->deferred = false;
+            deferred_count--;
+            stats.deferred_reuses++;
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/* Make the README invariant (no adjacent free blocks) hold before anything observes the list */
+static inline void settle(void)
+{
+    if (deferred_head)
+        coalesce_deferred();
+}
+
+/**
+ * Enable or disable deferred coalescing. Freed blocks are coalesced in one batch once the quick
+ * list holds threshold blocks, when an allocation finds no parked block of its exact size, and
+ * before any status query, so queries always see fully merged free space.
+ * @param threshold parked blocks that trigger a batch; 0 coalesces immediately (the default)
+ */
+void mem_set_deferred_coalescing(size_t threshold)
+{
+    POOL_LOCK();
+    coalesce_deferred();
+    wake_waiters();
+    deferred_threshold = threshold;
+    POOL_UNLOCK();
+}
+
+/**
+ * Number of frees parked and not coalesced yet. Unlike the status queries it leaves them parked,
+ * so it shows how far the maintenance thread is behind.
+ * @return parked blocks
+ */
+size_t mem_parked_count(void)
+{
+    POOL_LOCK();
+    size_t parked = deferred_count;
+    POOL_UNLOCK();
+    return parked;
+}
+
+/* Coalesce every parked free block now */
+void mem_coalesce(void)
+{
+    POOL_LOCK();
+    coalesce_deferred();
+    wake_waiters();
+    POOL_UNLOCK();
+}
+
+/*
+ * Exact-size recycle cache in front of the strategies, tcache style. Every bin holds a LIFO stack
+ * of freed blocks of one size, linked through qnext. Cached blocks stay allocated as far as the
+ * memory list and the counters are concerned until mem_cache_flush hands them back, which is what
+ * makes a hit O(1): no search, no split, no merge. Bins are found through a small open-addressed
+ * table keyed by size; when all bins are taken, sizes without a bin are simply not cached.
+ */
+#define CACHE_BINS 64
+
+typedef struct
+{
+    size_t size;
+    size_t count;
+    memoryList *top;
+} cache_bin;
+
+static cache_bin cache_bins[CACHE_BINS];
+static size_t cache_max_count;
+static size_t cache_max_bytes;
+
+static cache_bin *cache_find_bin(size_t size, bool create)
+{
+    size_t slot = (size * 0x9e3779b97f4a7c15ull) >> 58;
+
+    for (int probe = 0; probe < CACHE_BINS; probe++, slot = (slot + 1) & (CACHE_BINS - 1))
+    {
+        if (cache_bins[slot].size == size)
+            return &cache_bins[slot];
+        if (!cache_bins[slot].size)
+        {
+            if (!create)
+                return NULL;
+            cache_bins[slot].size = size;
+            return &cache_bins[slot];
+        }
+    }
+
+    return NULL;
+}
+
+/* Try to keep a block that is being freed in its size bin */
+static bool cache_put(memoryList *block)
+{
+    if (!block->size || stats.cached_bytes + block->size > cache_max_bytes)
+        return false;
+
+    cache_bin *bin = cache_find_bin(block->size, true);
+    if (!bin || bin->count >= cache_max_count)
+        return false;
+
+    block->cached = true;
+    block->qnext = bin->top;
+    bin->top = block;
+    bin->count++;
+    stats.cached_blocks++;
+    stats.cached_bytes += block->size;
+    return true;
+}
+
+static void *cache_get(size_t requested)
+{
+    cache_bin *bin = cache_find_bin(requested, false);
+    memoryList *block = bin ? bin->top : NULL;
+
+    if (!block)
+    {
+        stats.cache_misses++;
+        return NULL;
+    }
+
+    bin->top = block->qnext;
+    bin->count--;
+    block->qnext = NULL;
+    block->cached = false;
+    stats.cached_blocks--;
+    stats.cached_bytes -= block->size;
+    stats.cache_hits++;
+    return block->ptr;
+}
+
+/* Return every cached block to the heap, merging as a normal free would */
+void mem_cache_flush(void)
+{
+    POOL_LOCK();
+    for (int i = 0; i < CACHE_BINS; i++)
+    {
+        while (cache_bins[i].top)
+        {
+            memoryList *block = cache_bins[i].top;
+            cache_bins[i].top = block->qnext;
+            block->qnext = NULL;
+            block->cached = false;
+            free_block(block);
+        }
+    }
+
+    memset(cache_bins, 0, sizeof(cache_bins));
+    stats.cached_blocks = 0;
+    stats.cached_bytes = 0;
+    wake_waiters();
+    POOL_UNLOCK();
+}
+
+/**
+ * Configure the exact-size recycle cache. It starts disabled; passing 0 for either bound flushes
+ * it and disables it again, which restores strict strategy semantics.
+ * @param max_per_size blocks kept per distinct size
+ * @param max_bytes bytes kept over all sizes
+ */
+void mem_cache_configure(size_t max_per_size, size_t max_bytes)
+{
+    POOL_LOCK();
+    mem_cache_flush();
+    cache_max_count = max_bytes ? max_per_size : 0;
+    cache_max_bytes = max_per_size ? max_bytes : 0;
+    POOL_UNLOCK();
+}
+
+/*
+ * Optional structure-of-arrays mirror of the memory list, see blocktable.h. While it is kept,
+ * every split, merge and state change is repeated in the table. It is only kept while enabled with mem_set_block_table, for firstfit to search and
+ * for mem_block_of to bisect.
+ */
+static bool use_block_table;
+static bool table_first_fit;
+static block_table table;
+
+/**
+ * Turns the block table on or off. Enabling builds it from the current memory list, and it is
+ * rebuilt by every initmem until it is turned off again
+ * @param enable true to maintain the table and search it
+ */
+void mem_set_block_table(bool enable)
+{
+    POOL_LOCK();
+    table_first_fit = enable;
+    if (enable && !use_block_table && head)
+        blocktable_build(&table, head, myMemory);
+    else if (!enable)
+        blocktable_free(&table);
+    use_block_table = enable;
+    POOL_UNLOCK();
+}
+
+/*
+ * Memory list nodes. While the maintenance thread runs, splits take nodes it allocated ahead of
+ * time and merges leave the nodes they retire for it to free, so neither calls the C allocator.
+ */
+static memoryList *spare_nodes;     // zeroed, linked through next
+static size_t spare_count;
+static memoryList *retired_nodes;   // linked through next
+
+/* Allocate a zeroed memory list node */
+static memoryList *new_block(void)
+{
+    memoryList *node = spare_nodes;
+    if (!node)
+        return (memoryList *) calloc(1, sizeof(memoryList));
+
+    spare_nodes = node->next;
+    spare_count--;
+    node->next = NULL;
+    return node;
+}
+
+/* Free a node a merge took out of the memory list, or leave it to the maintenance thread */
+static void retire_node(memoryList *node)
+{
+    if (!maintenance_running)
+    {
+        free(node);
+        return;
+    }
+
+    node->next = retired_nodes;
+    retired_nodes = node;
+}
+
+static void free_nodes(memoryList *node)
+{
+    while (node)
+    {
+        memoryList *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+/*
+ * Background maintenance thread. It takes the housekeeping off the caller's thread: coalescing
+ * deferred frees, freeing retired nodes and allocating spare ones, handing the whole pages inside
+ * large holes back to the kernel and rescanning for the largest hole. The pool work is done under
+ * pool_lock in steps of at most MAINT_BATCH blocks or holes and MAINT_TRIMS madvise calls, so a
+ * caller never waits long for the lock; the node allocations happen with the lock released.
+ */
+#define MAINT_BATCH 64
+#define MAINT_TRIMS 4
+#define MAINT_TRIM_MIN (64 * 1024)      // smaller holes keep their pages
+#define MAINT_SPARE_NODES 256
+
+static pthread_once_t maintenance_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t maintenance_wake;
+static pthread_t maintenance_thread;
+static unsigned maintenance_interval_ms;
+static bool maintenance_stopping;
+static bool maintenance_pass;       // a trim pass is under way, trim_cursor is its position
+
+static void maintenance_init(void)
+{
+    pthread_once(&pool_lock_once, pool_lock_init);
+    pthread_cond_init(&maintenance_wake, &monotonic_cond);
+}
+
+/* Release the whole pages inside a large hole, once per hole until it changes again */
+static bool trim_hole(memoryList *hole)
+{
+    static uintptr_t page;
+    if (!page)
+        page = sysconf(_SC_PAGESIZE);
+
+    uintptr_t start = ((uintptr_t) hole->ptr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) hole->ptr + hole->size) & ~(page - 1);
+    if (hole->trimmed || hole->size < MAINT_TRIM_MIN || end <= start)
+        return false;
+
+    // The pages read back as zeros on the next touch, which is all a hole needs
+    hole->trimmed = true;
+    if (!madvise((void *) start, end - start, MADV_DONTNEED))
+        stats.trimmed_bytes += end - start;
+    return true;
+}
+
+/* One step of the trim pass, false once the pass went past the last hole */
+static bool trim_step(void)
+{
+    int visited = 0, trims = 0;
+
+    while (trim_cursor && visited < MAINT_BATCH && trims < MAINT_TRIMS)
+    {
+        trims += trim_hole(trim_cursor);
+        visited++;
+        trim_cursor = trim_cursor->fnext != free_head ? trim_cursor->fnext : NULL;
+    }
+
+    return trim_cursor != NULL;
+}
+
+/* Free the retired nodes and top up the spare ones, with the pool unlocked meanwhile */
+static void recycle_nodes(void)
+{
+    memoryList *retired = retired_nodes;
+    size_t missing = spare_count < MAINT_SPARE_NODES / 2 ? MAINT_SPARE_NODES - spare_count : 0;
+    memoryList *spares = NULL, *last = NULL;
+    size_t added = 0;
+
+    if (!retired && !missing)
+        return;
+    retired_nodes = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    free_nodes(retired);
+    for (; added < missing; added++)
+    {
+        memoryList *node = calloc(1, sizeof(memoryList));
+        if (!node)
+            break;
+        node->next = spares;
+        spares = node;
+        if (!last)
+            last = node;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (spares)
+    {
+        last->next = spare_nodes;
+        spare_nodes = spares;
+        spare_count += added;
+    }
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void *maintenance_main(void *unused)
+{
+    struct timespec next_pass, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_pass);
+    timespec_add_ms(&next_pass, maintenance_interval_ms);
+
+    pthread_mutex_lock(&pool_lock);
+    while (!maintenance_stopping)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool due = now.tv_sec > next_pass.tv_sec || (now.tv_sec == next_pass.tv_sec && now.tv_nsec >= next_pass.tv_nsec);
+
+        // Parked frees go first, myfree wakes the thread when half the threshold is parked
+        if (deferred_head && (maintenance_pass || deferred_count >= deferred_threshold / 2))
+        {
+            stats.background_frees += coalesce_parked(MAINT_BATCH);
+            wake_waiters();
+        }
+        else if (maintenance_pass)
+        {
+            if (!trim_step())
+            {
+                maintenance_pass = false;
+                if (!largest_free_valid)
+                    refresh_largest_free();
+                stats.maintenance_passes++;
+                next_pass = now;
+                timespec_add_ms(&next_pass, maintenance_interval_ms);
+            }
+        }
+        else if (due)
+        {
+            maintenance_pass = true;
+            trim_cursor = free_head;
+        }
+        else
+        {
+            pthread_cond_timedwait(&maintenance_wake, &pool_lock, &next_pass);
+            continue;
+        }
+
+        recycle_nodes();
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return unused;
+}
+
+static void maintenance_start(void)
+{
+    if (!maintenance_interval_ms || !head || myStrategy == Bitmap)
+        return;
+
+    pthread_once(&maintenance_once, maintenance_init);
+    maintenance_stopping = false;
+    maintenance_pass = false;
+    trim_cursor = NULL;
+
+    // The thread relies on both flags from its first step on
+    maintenance_running = use_pool_lock = true;
+    if (pthread_create(&maintenance_thread, NULL, maintenance_main, NULL))
+    {
+        maintenance_running = false;
+        use_pool_lock = shared_pool;
+    }
+}
+
+/* Let the thread finish its current step and join it; the pool is left consistent */
+static void maintenance_stop(void)
+{
+    if (!maintenance_running)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    maintenance_stopping = true;
+    pthread_cond_signal(&maintenance_wake);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_join(maintenance_thread, NULL);
+
+    maintenance_running = false;
+    use_pool_lock = shared_pool;
+    free_nodes(retired_nodes);
+    retired_nodes = NULL;
+}
+
+/**
+ * Starts the background maintenance thread, or stops it. Every interval it makes a pass over
+ * the holes, and it coalesces deferred frees as soon as half of the mem_set_deferred_coalescing
+ * threshold is parked, so with the thread running the threshold is only a backstop and
+ * allocations no longer merge parked blocks unless their search fails. The setting survives
+ * initmem, which stops the thread before discarding the pool and starts it again for the new
+ * one. The Bitmap strategy is never maintained.
+ * @param interval_ms milliseconds between passes, 0 stops the thread (the default)
+ */
+void mem_set_maintenance(unsigned interval_ms)
+{
+    maintenance_stop();
+    maintenance_interval_ms = interval_ms;
+    maintenance_start();
+}
+
+/**
+ * Declares whether several threads call into the pool. While shared, every public function
+ * holds the pool lock, which is also what lets mymalloc_wait sleep until another thread frees.
+ * Change it only while no other thread is using the pool.
+ * @param shared true before a second thread starts using the pool
+ */
+void mem_set_shared(bool shared)
+{
+    pthread_once(&pool_lock_once, pool_lock_init);
+    shared_pool = shared;
+    use_pool_lock = shared || maintenance_running;
+}
+
+/*
+ * Blocking allocation. Every caller of mymalloc_wait that found no room queues on its own
+ * condition variable, FIFO within its power-of-two size class, and numbered in order of arrival
+ * across all classes. Whenever free space grows, the oldest waiter is woken if its request fits
+ * the largest hole, and once it has allocated it wakes the next one the same way; no other
+ * waiter is woken while one is on its way. Nobody overtakes an older waiter, so a large request
+ * is not starved by a stream of small ones, and a woken waiter that still finds no room goes back
+ * to the front of its class.
+ */
+typedef struct mem_waiter
+{
+    size_t size;
+    uint64_t arrival;
+    bool woken;
+    pthread_cond_t wake;
+    struct mem_waiter *next;
+} mem_waiter;
+
+static mem_waiter *waiters[MEM_HOLE_BUCKETS];
+static mem_waiter *waiters_tail[MEM_HOLE_BUCKETS];
+static size_t waiter_count;
+static uint64_t waiter_arrivals;
+static bool waiter_woken;           // a woken waiter has not retried its allocation yet
+
+static void waiter_enqueue(mem_waiter *waiter, bool front)
+{
+    int class = hole_bucket(waiter->size);
+
+    waiter->woken = false;
+    if (front)
+    {
+        waiter->next = waiters[class];
+        waiters[class] = waiter;
+        if (!waiter->next)
+            waiters_tail[class] = waiter;
+    }
+    else
+    {
+        waiter->arrival = waiter_arrivals++;
+        waiter->next = NULL;
+        if (waiters[class])
+            waiters_tail[class]->next = waiter;
+        else
+            waiters[class] = waiter;
+        waiters_tail[class] = waiter;
+    }
+    waiter_count++;
+}
+
+static void waiter_dequeue(mem_waiter *waiter)
+{
+    int class = hole_bucket(waiter->size);
+    mem_waiter *previous = NULL;
+
+    for (mem_waiter *current = waiters[class]; current; previous = current, current = current->next)
+    {
+        if (current != waiter)
+            continue;
+        if (previous)
+            previous->next = waiter->next;
+        else
+            waiters[class] = waiter->next;
+        if (waiters_tail[class] == waiter)
+            waiters_tail[class] = previous;
+        waiter_count--;
+        return;
+    }
+}
+
+/**
+ * @return number of mymalloc_wait calls queued for space and not woken yet
+ */
+size_t mem_waiting_count(void)
+{
+    POOL_LOCK();
+    size_t waiting = waiter_count;
+    POOL_UNLOCK();
+    return waiting;
+}
+
+/* Wake the oldest waiter if its request fits now, with the pool locked */
+static void wake_waiters(void)
+{
+    if (!waiter_count || waiter_woken)
+        return;
+
+    // The head of each class is the oldest in it, so the oldest overall is one of the heads
+    mem_waiter *waiter = NULL;
+    for (int class = 0; class < MEM_HOLE_BUCKETS; class++)
+        if (waiters[class] && (!waiter || waiters[class]->arrival < waiter->arrival))
+            waiter = waiters[class];
+    if (waiter->size > largest_free_now())
+        return;
+
+    waiter_dequeue(waiter);
+    waiter->woken = waiter_woken = true;
+    pthread_cond_signal(&waiter->wake);
+}
+
+/**
+ * Allocates like mymalloc, but when there is no room waits for frees to make some, for at most
+ * timeout_ms. Frees from other threads only reach the waiter with mem_set_shared(true); in a
+ * single-threaded pool only the maintenance thread can free space, and without either this is
+ * plain mymalloc. While anybody waits, myfree bypasses the recycle cache and deferred coalescing
+ * so the space becomes visible at once.
+ * @param requested the size needed
+ * @param timeout_ms longest wait in milliseconds, 0 to not wait, negative to wait indefinitely
+ * @return the block, or NULL if there was still no room when the timeout ran out
+ */
+void *mymalloc_wait(size_t requested, int timeout_ms)
+{
+    mem_waiter waiter = {requested};
+    struct timespec deadline;
+    bool queued_before = false;
+    void *ptr;
+
+    POOL_LOCK();
+    while (!(ptr = mymalloc(requested)) && use_pool_lock && timeout_ms)
+    {
+        if (!queued_before)
+        {
+            // Cached blocks are free space nobody else can use, hand them back before sleeping
+            mem_cache_flush();
+            if ((ptr = mymalloc(requested)))
+                break;
+
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            if (timeout_ms > 0)
+                timespec_add_ms(&deadline, timeout_ms);
+            pthread_cond_init(&waiter.wake, &monotonic_cond);
+        }
+
+        waiter_enqueue(&waiter, queued_before);
+        queued_before = true;
+
+        int error = 0;
+        while (!waiter.woken && error != ETIMEDOUT)
+            error = timeout_ms < 0 ? pthread_cond_wait(&waiter.wake, &pool_lock)
+                                   : pthread_cond_timedwait(&waiter.wake, &pool_lock, &deadline);
+        if (!waiter.woken)
+        {
+            waiter_dequeue(&waiter);
+            break;
+        }
+        waiter_woken = false;
+    }
+
+    // Whatever this allocation left over may fit the next waiter
+    if (ptr)
+        wake_waiters();
+    if (queued_before)
+        pthread_cond_destroy(&waiter.wake);
+    POOL_UNLOCK();
+
+    return ptr;
+}
 
 /**
  * Initializes the memory and if called more than once it free the previous allocated memory
@@ -15,38 +1169,316 @@ static memoryList *last_allocated;
  */
 void initmem(strategies strategy, size_t sz)
 {
-    myStrategy = strategy;
+#ifdef MYMEM_FIXED_STRATEGY
+    // mymalloc is compiled for one strategy only
+    assert(strategy == MYMEM_FIXED_STRATEGY);
+#endif
+    // Nothing may touch the old pool while it goes away
+    maintenance_stop();
+    myStrategy = strategy;
+
+    // If not the first time initmem is called then we free the old myMemory
+    if (myMemory)
+    {
+        pool_destroy(myMemory);
+        myMemory = NULL;
+    }
+
+    // If current is not null then it's not the first time, and we free the old allocations
+    memprof_pool_reset();
+    deferred_head = NULL;
+    deferred_count = 0;
+    memset(cache_bins, 0, sizeof(cache_bins));
+    stack_base = NULL;
+    stack_size = stack_top = 0;
+    handles_reset();
+    if (directory)
+        memset(directory, 0, directory_capacity * sizeof(memoryList *));
+    directory_count = 0;
+    free_nodes(head);
+    free_nodes(spare_nodes);
+    spare_nodes = NULL;
+    spare_count = 0;
+
+    // Allocate an actual block of memory to be used by the memory manager
+    mySize = sz;
+    myMemory = pool_create(sz);
+
+    // The bitmap strategy only manages whole granules and keeps the memory list as a single hole
+    if (strategy == Bitmap)
+        mySize = bitmap_init(myMemory, sz);
+    else
+        bitmap_release();
+
+    // Initialize the data structure for the memory list
+    head = new_block();
+    head->alloc = false;
+    head->size = mySize;
+    head->ptr = myMemory;
+    head->next = head->prev = NULL;
+    head->fnext = head->fprev = head;
+    free_head = rover = short_rover = head;
+    rover_offset = 0;
+    use_block_table = table_first_fit;
+    if (use_block_table)
+        blocktable_build(&table, head, myMemory);
+
+    memset(&stats, 0, sizeof(stats));
+    stats.total_bytes = mySize;
+    stats.blocks = 1;
+    stats.largest_free = mySize;
+    stats.committed_bytes = committed_chunks ? 0 : mySize;
+    stats.commit_high_water = stats.committed_bytes;
+    largest_free_valid = true;
+    memset(hole_buckets, 0, sizeof(hole_buckets));
+    hole_added(head);
+
+    maintenance_start();
+}
+
+/*
+ * The early rejection against the largest hole, then the strategy's search and the split.
+ * Short-lived blocks go through the mirrored search and are cut from the top of their hole.
+ */
+static void *search_with(strategies strategy, size_t requested, bool high)
+{
+    if (requested > (largest_free_valid ? stats.largest_free : refresh_largest_free()))
+    {
+        INSTR_COUNT(early_rejections);
+        return NULL;
+    }
+    if (high)
+        return allocate_high(high_fit(strategy, requested), requested);
+
+    switch (strategy)
+    {
+        case NotSet:
+        case Bitmap:
+            break;
+        case First:
+            return allocate_block(first_fit(requested), requested);
+        case Best:
+            return allocate_block(best_fit(requested), requested);
+        case Worst:
+            return allocate_block(worst_fit(requested), requested);
+        case Next:
+            return allocate_block(next_fit(requested), requested);
+    }
+
+    return NULL;
+}
+
+/*
+ * The allocation path with the strategy as a parameter, mymalloc passing myStrategy and the
+ * specialised entry points a constant. Forcing the search and the split inline into one copy per
+ * strategy measured within noise of this, so the compiler decides.
+ */
+static void *allocate_with(strategies strategy, size_t requested, bool high)
+{
+    void *ptr = NULL;
+
+    if (stack_base)
+        return stack_alloc(requested);
+
+    if (strategy == Bitmap)
+    {
+        if ((ptr = bitmap_malloc(requested)) && !commit(ptr, requested))
+        {
+            bitmap_free(ptr, requested);
+            ptr = NULL;
+        }
+        if (!ptr)
+            stats.failed_allocations++;
+        return ptr;
+    }
+
+    if (cache_max_count && (ptr = cache_get(requested)))
+        return ptr;
+
+    // Recycle a parked block of the same size, otherwise the parked blocks must be merged first,
+    // unless the maintenance thread merges them, then only a failed search waits for that
+    if (deferred_head)
+    {
+        memoryList *reused = take_deferred(requested);
+        if (reused)
+            return reused->ptr;
+        if (!maintenance_running)
+            coalesce_deferred();
+    }
+
+    while (!(ptr = search_with(strategy, requested, high)) && deferred_head)
+        coalesce_deferred();
+
+    // Straight back into the pool, the cache and the quick list only hold committed blocks
+    if (ptr && !commit(ptr, requested))
+    {
+        free_block(directory_lookup(ptr));
+        ptr = NULL;
+    }
+    if (!ptr)
+        stats.failed_allocations++;
+    return ptr;
+}
+
+/* allocate_with plus the profiler's sampling countdown */
+static void *mymalloc_with(strategies strategy, size_t requested)
+{
+    POOL_LOCK();
+    void *ptr = allocate_with(strategy, requested, false);
+    if (ptr)
+        memprof_on_alloc(ptr, requested);
+    POOL_UNLOCK();
+    return ptr;
+}
+
+/* Same for a short-lived block, placed from the high end of the pool */
+static void *mymalloc_short(size_t requested)
+{
+    POOL_LOCK();
+    void *ptr = allocate_with(myStrategy, requested, true);
+    if (ptr)
+        memprof_on_alloc(ptr, requested);
+    POOL_UNLOCK();
+    return ptr;
+}
+
+/*
+ * Line colouring, see mem_set_line_colouring. Small blocks are rounded up to whole cache lines
+ * and start on a line boundary, colour_count lines apart in turn.
+ */
+#define CACHE_LINE 64
+
+static size_t colour_max;       // largest request coloured, 0 when colouring is off
+static unsigned colour_count = 1;
+static unsigned colour_next;
+
+/* Whether allocate_coloured may have carved a block of this size, a whole number of lines */
+static inline bool coloured_size(size_t size)
+{
+    return colour_max && size && (size - 1) / CACHE_LINE <= (colour_max - 1) / CACHE_LINE;
+}
+
+/* The pool strategy's hole for a coloured block, with the early rejection */
+static memoryList *coloured_fit(size_t need)
+{
+    if (need > largest_free_now())
+        return NULL;
+
+    switch (myStrategy)
+    {
+        case First:
+            return first_fit(need);
+        case Best:
+            return best_fit(need);
+        case Worst:
+            return worst_fit(need);
+        default:
+            return next_fit(need);
+    }
+}
+
+/* Cut a hole in two, the bytes from lead on becoming a new hole right after it */
+static memoryList *split_hole(memoryList *hole, size_t lead)
+{
+    memoryList *right = new_block();
+
+    hole_removed(hole);
+    right->alloc = false;
+    right->trimmed = hole->trimmed;
+    right->size = hole->size - lead;
+    right->ptr = (char *) hole->ptr + lead;
+    right->prev = hole;
+    right->next = hole->next;
+    if (hole->next)
+        hole->next->prev = right;
+    hole->next = right;
+    hole->size = lead;
+    free_list_link(right, hole->fnext);
+    if (use_block_table)
+    {
+        blocktable_update(&table, hole);
+        blocktable_insert(&table, right);
+    }
 
-    // If not the first time initmem is called then we free the old myMemory
-    if (myMemory)
+    hole_added(hole);
+    hole_added(right);
+    stats.splits++;
+    stats.blocks++;
+    INSTR_COUNT(splits);
+    return right;
+}
+
+/*
+ * Carves a line-aligned block. The search asks for enough room to align anywhere in the hole,
+ * then the bytes in front of the aligned start are cut off as a hole of their own and the block
+ * is allocated from the start of the rest, so the telemetry sees the splits that really happen.
+ * Recycled blocks are not line aligned, so the cache and the quick list are bypassed.
+ */
+static void *allocate_coloured(size_t requested)
+{
+    size_t size = requested ? (requested + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1) : CACHE_LINE;
+    size_t stagger = colour_next++ % colour_count * CACHE_LINE;
+    size_t need = size + stagger + CACHE_LINE - 1;
+    memoryList *hole;
+
+    while (!(hole = coloured_fit(need)) && deferred_head)
+        coalesce_deferred();
+    if (!hole)
     {
-        free(myMemory);
-        myMemory = NULL;
+        stats.failed_allocations++;
+        return NULL;
     }
 
-    // If current is not null then it's not the first time, and we free the old allocations
-    memoryList *current = head;
-    memoryList *next;
-    while (current)
+    uintptr_t start = (uintptr_t) hole->ptr;
+    size_t lead = ((start + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1)) - start + stagger;
+    if (lead)
+        hole = split_hole(hole, lead);
+    void *ptr = allocate_block(hole, size);
+
+    if (!commit(ptr, size))
     {
-        next = current->next;
-        free(current);
-        current = next;
+        free_block(directory_lookup(ptr));
+        stats.failed_allocations++;
+        return NULL;
     }
+    return ptr;
+}
 
-    // Allocate an actual block of memory to be used by the memory manager
-    mySize = sz;
-    myMemory = malloc(sz);
+/* allocate_coloured under the pool lock, a stack allocation while the stack mode is on */
+static void *mymalloc_coloured(size_t requested)
+{
+    POOL_LOCK();
+    void *ptr = stack_base ? stack_alloc(requested) : allocate_coloured(requested);
+    if (ptr)
+        memprof_on_alloc(ptr, requested);
+    POOL_UNLOCK();
+    return ptr;
+}
 
-    // Initialize the data structure for the memory list
-    head = (memoryList *) malloc(sizeof(memoryList));
-    head->alloc = false;
-    head->size = mySize;
-    head->ptr = myMemory;
-    head->next = head->prev = NULL;
-    last_allocated = head;
+/**
+ * Spreads small blocks over cache lines so objects handed to different threads never share
+ * one. mymalloc rounds requests up to max_bytes to whole 64-byte lines and starts them on a line
+ * boundary, and with more than one colour it also moves each successive block's start along by
+ * one more line, wrapping after colours lines, so hot blocks do not all land in the same cache
+ * sets. Bitmap pools and mymalloc_hint are not affected. It stays set across initmem.
+ * @param max_bytes largest request to colour, 0 to pack blocks as usual (the default)
+ * @param colours number of staggered start lines, 1 to only align
+ */
+void mem_set_line_colouring(size_t max_bytes, unsigned colours)
+{
+    POOL_LOCK();
+    colour_max = max_bytes;
+    colour_count = colours ? colours : 1;
+    colour_next = 0;
+    POOL_UNLOCK();
 }
 
+/*
+ * Requests of at most this many bytes are predicted to be short-lived when mymalloc is given no
+ * hint, 0 turns the prediction off. See mem_set_lifetime_prediction.
+ */
+static size_t short_lived_max;
+
 /**
  *  Allocate a block of memory with the requested size.
  *  Restriction: requested >= 0
@@ -55,26 +1487,151 @@ void initmem(strategies strategy, size_t sz)
  */
 void *mymalloc(size_t requested)
 {
+    if (colour_max && requested <= colour_max && myStrategy != Bitmap)
+        return mymalloc_coloured(requested);
+    if (short_lived_max && requested <= short_lived_max && myStrategy != Bitmap)
+        return mymalloc_short(requested);
+#ifdef MYMEM_FIXED_STRATEGY
+    return mymalloc_with(MYMEM_FIXED_STRATEGY, requested);
+#else
     assert((int)myStrategy > 0);
-    // Check if there is a block large enough to hold the requested
-    if (requested > mem_largest_free())
-        return NULL;
+    return mymalloc_with(myStrategy, requested);
+#endif
+}
 
-    switch (myStrategy)
+/*
+ * Specialised allocation entry points for a pool known to use one strategy. They skip the
+ * dispatch entirely and must only be called after initmem with the matching strategy.
+ */
+void *mymalloc_first(size_t requested)
+{
+    assert(myStrategy == First);
+    return mymalloc_with(First, requested);
+}
+
+void *mymalloc_best(size_t requested)
+{
+    assert(myStrategy == Best);
+    return mymalloc_with(Best, requested);
+}
+
+void *mymalloc_worst(size_t requested)
+{
+    assert(myStrategy == Worst);
+    return mymalloc_with(Worst, requested);
+}
+
+void *mymalloc_next(size_t requested)
+{
+    assert(myStrategy == Next);
+    return mymalloc_with(Next, requested);
+}
+
+/**
+ * Allocates with a lifetime hint. Long-lived blocks are placed from the low end of the pool and
+ * short-lived ones from the high end, each with the pool's strategy, so the short-lived churn
+ * stays away from the long-lived blocks instead of leaving holes pinned between them. Bitmap
+ * pools ignore the hint.
+ * @param requested the size needed for the block
+ * @param lifetime LifetimeShort, LifetimeLong, or LifetimeUnknown to place it like mymalloc
+ * @return the block, NULL if no block was allocated
+ */
+void *mymalloc_hint(size_t requested, mem_lifetime lifetime)
+{
+    if (lifetime == LifetimeShort && myStrategy != Bitmap)
+        return mymalloc_short(requested);
+    if (lifetime == LifetimeLong)
     {
-        case NotSet:
-            return NULL;
-        case First:
-            return allocate_block_of_memory(firstfit(requested), requested);
-        case Best:
-            return allocate_block_of_memory(bestfit(requested), requested);
-        case Worst:
-            return allocate_block_of_memory(worstfit(requested), requested);
-        case Next:
-            return allocate_block_of_memory(nextfit(requested), requested);
-        default:
-            return NULL;
+#ifdef MYMEM_FIXED_STRATEGY
+        return mymalloc_with(MYMEM_FIXED_STRATEGY, requested);
+#else
+        return mymalloc_with(myStrategy, requested);
+#endif
+    }
+    return mymalloc(requested);
+}
+
+/**
+ * Predicts lifetimes from sizes for mymalloc calls without a hint: requests up to max_bytes are
+ * treated as short-lived, larger ones as long-lived. It stays set across initmem.
+ * @param max_bytes largest request predicted to be short-lived, 0 to stop predicting (the default)
+ */
+void mem_set_lifetime_prediction(size_t max_bytes)
+{
+    short_lived_max = max_bytes;
+}
+
+/**
+ * Makes the following initmem calls reserve the pool instead of allocating it. The pool is then
+ * mapped without access and committed in 2 MiB chunks as allocations first reach them, so setting
+ * up a large pool costs nothing until it is used. mem_stats reports what has been committed.
+ * Pools that cannot be mapped are allocated with malloc as usual.
+ * @param on true to reserve pools, false to malloc them (the default)
+ */
+void mem_set_lazy_commit(bool on)
+{
+    lazy_commit = on;
+}
+
+/**
+ * Starts the stack mode for callers that allocate in strict LIFO order. The stack takes one
+ * block of the given size from the heap, placed by the pool's strategy, and until mem_stack_end
+ * every mymalloc bumps a pointer inside it, to the next multiple of _Alignof(max_align_t). That
+ * includes coloured and hinted requests, so line colouring and lifetime prediction are off until
+ * mem_stack_end. myfree ignores those blocks, they are popped all at once with mem_release.
+ * Other blocks are still freed as usual.
+ * @param bytes size of the stack
+ * @return false if the heap has no room for it or a stack is already active
+ */
+bool mem_stack_begin(size_t bytes)
+{
+    POOL_LOCK();
+    void *base = stack_base || !bytes ? NULL : allocate_with(myStrategy, bytes, false);
+    if (base)
+    {
+        stack_base = base;
+        stack_size = bytes;
+        stack_top = 0;
     }
+    POOL_UNLOCK();
+
+    return base != NULL;
+}
+
+/* Leaves the stack mode, dropping whatever is still on the stack and freeing its block */
+void mem_stack_end(void)
+{
+    POOL_LOCK();
+    char *base = stack_base;
+    stack_base = NULL;
+    stack_size = stack_top = 0;
+    if (base)
+        myfree(base);
+    POOL_UNLOCK();
+}
+
+/**
+ * @return the current stack position, to pass to mem_release
+ */
+size_t mem_mark(void)
+{
+    POOL_LOCK();
+    size_t mark = stack_top;
+    POOL_UNLOCK();
+    return mark;
+}
+
+/**
+ * Pops every stack allocation made since mem_mark returned mark, in O(1)
+ * @param mark a position returned by mem_mark since the last mem_release below it
+ */
+void mem_release(size_t mark)
+{
+    POOL_LOCK();
+    assert(mark <= stack_top);
+    if (mark <= stack_top)
+        stack_top = mark;
+    POOL_UNLOCK();
 }
 
 /**
@@ -86,28 +1643,38 @@ void *mymalloc(size_t requested)
  * @param requested_size the size to allocated the new block
  * @return the pointer to the myMemory location of the new block
  */
-void *allocate_block_of_memory(memoryList *block_to_allocate, size_t requested_size)
+static void *allocate_block(memoryList *block_to_allocate, size_t requested_size)
 {
     // Check the block received is a valid mem
-    assert(block_to_allocate->size >= requested_size);
     if (!block_to_allocate)
         return NULL;
+    assert(!block_to_allocate->alloc && block_to_allocate->size >= requested_size);
+
+    hole_removed(block_to_allocate);
+    stats.allocated_bytes += requested_size;
+    rover_offset = (char *) block_to_allocate->ptr + requested_size - (char *) myMemory;
 
     // If the position given is equal to the requested size then overtake the block and return the pointer
     if (block_to_allocate->size == requested_size)
     {
+        // Next-fit carries on from the hole after this one
+        rover = block_to_allocate->fnext;
+        free_list_remove(block_to_allocate);
         block_to_allocate->alloc = true;
+        directory_insert(block_to_allocate);
+        if (use_block_table)
+            blocktable_update(&table, block_to_allocate);
         return block_to_allocate->ptr;
     }
 
     // Request block is smaller than the block to allocate, and we therefore need to divide the memory into two
-    memoryList *split_block = (memoryList *) malloc(sizeof(memoryList));
+    memoryList *split_block = new_block();
 
     // Update head if we take its place with our split
     if (block_to_allocate == head)
         head = split_block;
-    // If we're splitting then we should also move our last pointer
-    last_allocated = split_block;
+    // The remainder keeps its place in the free list and is where next-fit carries on
+    rover = block_to_allocate;
 
     // Setting values for the left side of our split block
     split_block->alloc = true;
@@ -116,167 +1683,511 @@ void *allocate_block_of_memory(memoryList *block_to_allocate, size_t requested_s
     split_block->next = block_to_allocate;
     split_block->prev = block_to_allocate->prev;
 
-    // Setting value for the right side of our split
-    block_to_allocate->size -= requested_size;
-    block_to_allocate->ptr = block_to_allocate->ptr + requested_size;
-    // Make sure to keep the linked list connected
-    if (block_to_allocate->prev)
-        block_to_allocate->prev->next = split_block;
-    block_to_allocate->prev = split_block;
+    // Setting value for the right side of our split
+    block_to_allocate->size -= requested_size;
+    block_to_allocate->ptr = block_to_allocate->ptr + requested_size;
+    // Make sure to keep the linked list connected
+    if (block_to_allocate->prev)
+        block_to_allocate->prev->next = split_block;
+    block_to_allocate->prev = split_block;
+    directory_insert(split_block);
+    if (use_block_table)
+        blocktable_split(&table, split_block, block_to_allocate);
+
+    hole_added(block_to_allocate);
+    stats.splits++;
+    stats.blocks++;
+    INSTR_COUNT(splits);
+
+    return split_block->ptr;
+}
+
+/**
+ * Search the linked list from head until an unallocated block is found that is larger than or
+ * equal to the requested size
+ * @param requested size
+ * @return memoryList ptr to the block of unallocated memory. Returns NULL if no block is found.
+ */
+static memoryList *first_fit(size_t requested)
+{
+    memoryList *current;
+    INSTR_DECLARE(visited);
+
+    if (table_first_fit)
+    {
+        size_t scanned;
+        current = blocktable_first_fit(&table, requested, &scanned);
+        INSTR_SEARCH(search[First], scanned);
+        return current;
+    }
+
+    for (current = head; current; current = current->next)
+    {
+        INSTR_STEP(visited);
+        if (!current->alloc && current->size >= requested)
+            break;
+    }
+
+    INSTR_SEARCH(search[First], visited);
+    return current;
+}
+
+/**
+ * Search the memory list from head to the end and find the largest block free which
+ * is larger than or equal to the requested size.
+ * @param requested size of the block needed
+ * @return memory list pointer to the free block and null if no free block available
+ */
+static memoryList *worst_fit(size_t requested)
+{
+    memoryList *current, *max_ptr;
+    INSTR_DECLARE(visited);
+
+    // Find the first unallocated struct and use it as the initial max
+    for(max_ptr = head; max_ptr && max_ptr->alloc; max_ptr = max_ptr->next)
+        INSTR_STEP(visited);
+
+    // Return NULL if we couldn't find a free space
+    if (!max_ptr)
+    {
+        INSTR_SEARCH(search[Worst], visited);
+        return max_ptr;
+    }
+
+    // Find the maximum sized free block
+    for (current = max_ptr; current; current = current->next)
+    {
+        INSTR_STEP(visited);
+        if (current->size > max_ptr->size && !current->alloc)
+            max_ptr = current;
+    }
+    INSTR_SEARCH(search[Worst], visited);
+
+    // Check if the requested size fit in the maximum sized block
+    if (max_ptr->size >= requested)
+        return  max_ptr;
+    else
+        return NULL;
+}
+
+/**
+ * Find the block with the best fit (the smallest difference in size) and return it
+ * @param requested size of the block needed
+ * @return memory list pointer to the free block and null if no free block available
+ */
+static memoryList *best_fit(size_t requested)
+{
+    memoryList *bestfit = NULL;
+    size_t smallest_diff = SIZE_MAX;
+    INSTR_DECLARE(visited);
+
+    for (memoryList *current = head; current; current = current->next)
+    {
+        INSTR_STEP(visited);
+        if (!current->alloc && current->size == requested)
+        {
+            INSTR_SEARCH(search[Best], visited);
+            return current;
+        }
+        if (!current->alloc && current->size > requested)
+        {
+            size_t diff = current->size - requested;
+
+            // Set smallest diff
+            if (diff < smallest_diff)
+            {
+                smallest_diff = diff;
+                bestfit = current;
+            }
+        }
+    }
+
+    INSTR_SEARCH(search[Best], visited);
+
+    // Null if there is nothing found
+    return bestfit;
+}
+
+/**
+ * Finds the first free block which fit the requested size from the location of the last allocated.
+ * Only holes are visited, starting at the rover and wrapping around the free list once
+ * @param requested size of the block needed
+ * @return memory list pointer to the free block and null if no free block available
+ */
+static memoryList *next_fit(size_t requested)
+{
+    memoryList *current = rover;
+    INSTR_DECLARE(visited);
+    if (!current)
+    {
+        INSTR_SEARCH(search[Next], visited);
+        return NULL;
+    }
+
+    do
+    {
+        INSTR_STEP(visited);
+        if (current->size >= requested)
+        {
+            INSTR_SEARCH(search[Next], visited);
+            rover = current;
+            return current;
+        }
+        current = current->fnext;
+    }
+    while (current != rover);
+
+    INSTR_SEARCH(search[Next], visited);
+    return NULL;
+}
+
+/**
+ * The strategies mirrored for short-lived blocks: holes are visited from the top of the pool
+ * down and ties go to the higher hole, next-fit carrying on from short_rover
+ * @param strategy the pool's strategy
+ * @param requested size of the block needed
+ * @return the hole to cut the block from, NULL if none fits
+ */
+static memoryList *high_fit(strategies strategy, size_t requested)
+{
+    memoryList *start = strategy == Next ? short_rover : free_head ? free_head->fprev : NULL;
+    memoryList *current = start, *found = NULL;
+
+    if (!start)
+        return NULL;
+
+    do
+    {
+        if (current->size >= requested)
+        {
+            if (strategy == First || strategy == Next || (strategy == Best && current->size == requested))
+            {
+                found = current;
+                break;
+            }
+            if (!found || (strategy == Best ? current->size < found->size : current->size > found->size))
+                found = current;
+        }
+        current = current->fprev;
+    }
+    while (current != start);
+
+    if (strategy == Next && found)
+        short_rover = found;
+    return found;
+}
+
+/**
+ * allocate_block for short-lived blocks: the block is cut from the top of the hole, which keeps
+ * its node and its place in the free list
+ * @param hole the hole found by high_fit
+ * @param requested the size of the new block
+ * @return the pointer to the new block, NULL if there is no hole
+ */
+static void *allocate_high(memoryList *hole, size_t requested)
+{
+    if (!hole)
+        return NULL;
+    assert(!hole->alloc && hole->size >= requested);
+
+    hole_removed(hole);
+    stats.allocated_bytes += requested;
+
+    if (hole->size == requested)
+    {
+        free_list_remove(hole);
+        hole->alloc = true;
+        directory_insert(hole);
+        if (use_block_table)
+            blocktable_update(&table, hole);
+        return hole->ptr;
+    }
+
+    memoryList *split_block = new_block();
+    split_block->alloc = true;
+    split_block->size = requested;
+    hole->size -= requested;
+    split_block->ptr = (char *) hole->ptr + hole->size;
+    split_block->prev = hole;
+    split_block->next = hole->next;
+    if (hole->next)
+        hole->next->prev = split_block;
+    hole->next = split_block;
+    directory_insert(split_block);
+    if (use_block_table)
+    {
+        blocktable_update(&table, hole);
+        blocktable_insert(&table, split_block);
+    }
+
+    hole_added(hole);
+    stats.splits++;
+    stats.blocks++;
+    INSTR_COUNT(splits);
+
+    return split_block->ptr;
+}
+
+/* Out-of-line entry points to the searches and the split, for callers outside mymalloc */
+void *allocate_block_of_memory(memoryList *block_to_allocate, size_t requested_size)
+{
+    return allocate_block(block_to_allocate, requested_size);
+}
+
+memoryList *firstfit(size_t requested)
+{
+    return first_fit(requested);
+}
+
+memoryList *worstfit(size_t requested)
+{
+    return worst_fit(requested);
+}
+
+memoryList *bestfit(size_t requested)
+{
+    return best_fit(requested);
+}
 
-    return split_block->ptr;
+memoryList *nextfit(size_t requested)
+{
+    return next_fit(requested);
 }
 
 /**
- * Search the linked list from head until an unallocated block is found that is larger than or
- * equal to the requested size
- * @param requested size
- * @return memoryList ptr to the block of unallocated memory. Returns NULL if no block is found.
+ * Frees a block of memory previously allocated by mymalloc by find the memory list block that it
+ * corresponds to and then either freeing it or setting its value to unallocated
+ * @param block the block in myMemory to free
  */
-memoryList *firstfit(size_t requested) {
-    memoryList *current;
-    for (current = head; current; current = current->next)
-        if (!current->alloc && current->size >= requested)
-            break;
+static void release_block(memoryList *);
+static void free_with_size(void *, size_t);
 
-    return current;
+void myfree(void *block)
+{
+    free_with_size(block, 0);
 }
 
 /**
- * Search the memory list from head to the end and find the largest block free which
- * is larger than or equal to the requested size.
- * @param requested size of the block needed
- * @return memory list pointer to the free block and null if no free block available
+ * Frees a block whose size the caller knows, as passed to mymalloc. The Bitmap strategy clears
+ * the granules without working out the block's length, and builds without NDEBUG check the
+ * size against the block first. Every build refuses a size that ends inside the next block.
+ * @param block the block in myMemory to free
+ * @param size the size it was allocated with
  */
-memoryList *worstfit(size_t requested)
+void myfree_sized(void *block, size_t size)
 {
-    memoryList *current, *max_ptr;
-
-    // Find the first unallocated struct and use it as the initial max
-    for(max_ptr = head; max_ptr && max_ptr->alloc; max_ptr = max_ptr->next)
-        ;
+    free_with_size(block, size);
+}
 
-    // Return NULL if we couldn't find a free space
-    if (!max_ptr)
-        return max_ptr;
+/* myfree and myfree_sized, size is 0 when the caller does not know it */
+static void free_with_size(void *block, size_t size)
+{
+    POOL_LOCK();
+    memprof_on_free(block);
+    // Stack allocations only go away with mem_release
+    if (in_stack(block))
+    {
+        POOL_UNLOCK();
+        return;
+    }
+    if (myStrategy == Bitmap)
+        bitmap_free(block, size);
+    else
+    {
+        memoryList *block_to_unalloc = directory_lookup(block);
+        // Coloured blocks were rounded up to whole lines
+        assert(!size || !block_to_unalloc || block_to_unalloc->size == size ||
+               block_to_unalloc->size == ((size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1)));
+        if (block_to_unalloc && !block_to_unalloc->deferred && !block_to_unalloc->cached)
+            release_block(block_to_unalloc);
+    }
+    wake_waiters();
+    POOL_UNLOCK();
+}
 
-    // Find the maximum sized free block
-    for (current = max_ptr; current; current = current->next)
-        if (current->size > max_ptr->size && !current->alloc)
-            max_ptr = current;
+/**
+ * Bytes the caller may use in an allocated block, which can be more than it asked for when the
+ * strategy rounds sizes up
+ * @param ptr a block returned by mymalloc
+ * @return the usable size, 0 if ptr is not an allocated block
+ */
+size_t mem_usable_size(void *ptr)
+{
+    size_t size = 0;
 
-    // Check if the requested size fit in the maximum sized block
-    if (max_ptr->size >= requested)
-        return  max_ptr;
+    POOL_LOCK();
+    if (in_stack(ptr))
+    {
+        POOL_UNLOCK();
+        return 0;
+    }
+    if (myStrategy == Bitmap)
+        size = bitmap_usable_size(ptr);
     else
-        return NULL;
+    {
+        memoryList *block = directory_lookup(ptr);
+        if (block && !block->deferred && !block->cached)
+            size = block->size;
+    }
+    POOL_UNLOCK();
+
+    return size;
 }
 
 /**
- * Find the block with the best fit (the smallest difference in size) and return it
- * @param requested size of the block needed
- * @return memory list pointer to the free block and null if no free block available
+ * Allocates a block and returns a handle for it instead of its address. Resolving or freeing a
+ * handle is an array index and a generation compare, and a stale handle, one already freed or
+ * issued before initmem, is rejected rather than freeing whatever block took its place. Blocks
+ * allocated this way must only be freed with myfree_handle. Handles take their block straight
+ * from the strategy, so line colouring and lifetime prediction do not apply to them, and while
+ * the stack mode is active no handle is issued and 0 is returned.
+ * @param requested the size needed for the block
+ * @return the handle, 0 if no block was allocated
  */
-memoryList *bestfit(size_t requested)
+mem_handle mymalloc_handle(size_t requested)
 {
-    memoryList *bestfit = NULL;
-    int smallest_diff = -1; // Start value
+    mem_handle handle = 0;
 
-    for (memoryList *current = head; current; current = current->next)
+    POOL_LOCK();
+    // A free slot is secured first, so a full slot table never costs an allocated block
+    if (stack_base || (handle_free == NO_SLOT && !handles_grow()))
     {
-        if (!current->alloc && current->size == requested)
-            return current;
-        if (!current->alloc && current->size > requested)
-        {
-            int diff = current->size - requested;
-
-            // Set smallest diff
-            if (smallest_diff == -1 || diff < smallest_diff)
-            {
-                smallest_diff = diff;
-                bestfit = current;
-            }
-        }
+        POOL_UNLOCK();
+        return 0;
     }
 
-    // Return null if there is nothing found
-    if (smallest_diff == -1)
-        return NULL;
+    void *ptr = allocate_with(myStrategy, requested, false);
+    if (ptr)
+    {
+        uint32_t index = handle_free;
+        handle_slot *slot = &handle_slots[index];
+        handle_free = slot->next_free;
+        slot->ptr = ptr;
+        slot->block = myStrategy == Bitmap ? NULL : directory_lookup(ptr);
+        handle = (mem_handle) slot->generation << 32 | index;
+        memprof_on_alloc(ptr, requested);
+    }
+    POOL_UNLOCK();
 
-    return bestfit;
+    return handle;
 }
 
 /**
- * Finds the first free block which fit the requested size from the location of the last allocated
- * @param requested size of the block needed
- * @return memory list pointer to the free block and null if no free block available
+ * @param handle a handle from mymalloc_handle
+ * @return the block's address, NULL if the handle is stale
  */
-memoryList *nextfit(size_t requested)
+void *mem_handle_get(mem_handle handle)
 {
-    memoryList *current = last_allocated;
-    if (!current->next)
-        current = head;
-    else
-        current = last_allocated->next;
+    POOL_LOCK();
+    handle_slot *slot = handle_resolve(handle);
+    void *ptr = slot ? slot->ptr : NULL;
+    POOL_UNLOCK();
+    return ptr;
+}
 
-    do
+/**
+ * Frees the block behind a handle without looking it up
+ * @param handle a handle from mymalloc_handle
+ * @return false if the handle is stale, in which case nothing is freed
+ */
+bool myfree_handle(mem_handle handle)
+{
+    POOL_LOCK();
+    handle_slot *slot = handle_resolve(handle);
+    if (slot)
     {
-        if (!current->alloc && current->size >= requested)
+        memprof_on_free(slot->ptr);
+        if (!slot->block)
+            bitmap_free(slot->ptr, 0);
+        else
         {
-            last_allocated = current;
-            return current;
+            assert(slot->block->alloc && slot->block->ptr == slot->ptr);
+            if (!slot->block->deferred && !slot->block->cached)
+                release_block(slot->block);
         }
-        if (!current->next)
-            current = head;
-        else
-            current = current->next;
+        handle_retire((uint32_t) handle);
+        wake_waiters();
     }
-    while (current != last_allocated->next);
+    POOL_UNLOCK();
 
-    return NULL;
+    return slot != NULL;
 }
 
-/**
- * Frees a block of memory previously allocated by mymalloc by find the memory list block that it
- * corresponds to and then either freeing it or setting its value to unallocated
- * @param block the block in myMemory to free
- */
-void myfree(void *block)
+/* Hand a block myfree found to the recycle cache, the deferred quick list or the real free */
+static void release_block(memoryList *block_to_unalloc)
 {
-    memoryList *block_to_unalloc = find_block(block);
-    if (!block_to_unalloc)
+    // Waiters need the space now rather than whenever the cache or the quick list gives it back,
+    // and coloured requests never take a block from either, so holding one would only pin it
+    bool recycle = !waiter_count && !coloured_size(block_to_unalloc->size);
+
+    if (recycle && cache_max_count && cache_put(block_to_unalloc))
         return;
 
-    // Freeing the only block in the memory list
-    if (!block_to_unalloc->next && !block_to_unalloc->prev)
-        goto unalloc_block;
+    if (recycle && deferred_threshold)
+    {
+        block_to_unalloc->deferred = true;
+        block_to_unalloc->qnext = deferred_head;
+        deferred_head = block_to_unalloc;
+        if (++deferred_count >= deferred_threshold)
+            coalesce_deferred();
+        else if (maintenance_running && deferred_count == deferred_threshold / 2)
+            pthread_cond_signal(&maintenance_wake);
+        return;
+    }
 
-    // If we are at head the next point needs to not be null to avoid looking at restricted memory
-    if (block_to_unalloc == head && block_to_unalloc->next && block_to_unalloc->next->alloc)
-        goto unalloc_block;
+    free_block(block_to_unalloc);
+}
 
-    // Same for tail
-    if (!block_to_unalloc->next && block_to_unalloc->prev && block_to_unalloc->prev->alloc)
-        goto unalloc_block;
+/**
+ * Set an allocated block free and merge it with free neighbours so no two holes are adjacent
+ * @param block_to_unalloc allocated block in the memory list
+ */
+static void free_block(memoryList *block_to_unalloc)
+{
+    memoryList *left = block_to_unalloc->prev;
+    memoryList *right = block_to_unalloc->next;
+    bool merge_with_left = left && !left->alloc;
+    bool merge_with_right = right && !right->alloc;
 
-    // In the middle if both sides of the block is allocated
-    if (block_to_unalloc->next && block_to_unalloc->prev &&
-        block_to_unalloc->next->alloc && block_to_unalloc->prev->alloc)
-        goto unalloc_block;
+    stats.allocated_bytes -= block_to_unalloc->size;
+    block_to_unalloc->trimmed = false;
+    directory_remove(block_to_unalloc);
 
+    // Both neighbours are allocated, or missing, so the block becomes a hole of its own
+    if (!merge_with_left && !merge_with_right)
+    {
+        block_to_unalloc->alloc = false;
+        free_list_insert(block_to_unalloc);
+        if (use_block_table)
+            blocktable_update(&table, block_to_unalloc);
+        hole_added(block_to_unalloc);
+        return;
+    }
 
+    // The left hole absorbs the block and keeps its place in the free list
     memoryList *mergedBlock = block_to_unalloc;
-    // Try to merge to the left
-    if (block_to_unalloc->prev && !block_to_unalloc->prev->alloc)
+    if (merge_with_left)
+    {
+        hole_removed(left);
         mergedBlock = merge_left(block_to_unalloc);
+    }
 
-    // Try to go right and merge left again
-    if (mergedBlock->next && !mergedBlock->next->alloc)
-        merge_left(mergedBlock->next);
-    return;
-
-    unalloc_block:
-    block_to_unalloc->alloc = false;
+    // Merge the right hole in, the merged block takes over its free list position if it has none
+    if (merge_with_right)
+    {
+        hole_removed(right);
+        if (mergedBlock == block_to_unalloc)
+            free_list_replace(right, mergedBlock);
+        else
+        {
+            if (rover == right)
+                rover = mergedBlock;
+            free_list_remove(right);
+        }
+        merge_left(right);
+    }
+    mergedBlock->trimmed = false;
+    hole_added(mergedBlock);
 }
 
 /**
@@ -286,7 +2197,11 @@ void myfree(void *block)
  */
 memoryList *find_block(void *block)
 {
-    memoryList *current;
+    memoryList *current = directory_lookup(block);
+    if (current)
+        return current;
+
+    // Holes are not in the directory
     for(current = head; current; current = current->next)
         if (current->ptr == block)
             break;
@@ -302,9 +2217,7 @@ memoryList *find_block(void *block)
  */
 memoryList *merge_left(memoryList *block_to_unalloc)
 {
-    // Update pointer to last allocated block if the old one gets merged.
-    if (block_to_unalloc == last_allocated)
-        last_allocated = block_to_unalloc->prev;
+    INSTR_COUNT(merge_left_calls);
 
     // Remove reference to the current block
     block_to_unalloc->prev->next = block_to_unalloc->next;
@@ -316,8 +2229,15 @@ memoryList *merge_left(memoryList *block_to_unalloc)
     block_to_unalloc->prev->alloc = false;
 
     memoryList *mergedBlock = block_to_unalloc->prev;
+    if (use_block_table)
+    {
+        blocktable_remove(&table, block_to_unalloc);
+        blocktable_update(&table, mergedBlock);
+    }
 
-    free(block_to_unalloc);
+    retire_node(block_to_unalloc);
+    stats.merges++;
+    stats.blocks--;
 
     return mergedBlock;
 }
@@ -328,63 +2248,373 @@ memoryList *merge_left(memoryList *block_to_unalloc)
  * memory pool this module manages via initmem/mymalloc/myfree.
  */
 
+/*
+ * The int functions are the original interface and clamp at INT_MAX, so they stay correct for
+ * pools up to 2 GiB. Larger pools need the size_t ones they wrap.
+ */
+static int saturate(size_t value)
+{
+    return value > INT_MAX ? INT_MAX : (int) value;
+}
+
 /* Get the number of contiguous areas of free space in memory. */
-int mem_holes(void)
+size_t mem_holes_count(void)
 {
-    int count = 0;
-    for (memoryList *current = head; current; current = current->next)
-        if (!current->alloc)
-            count++;
+    POOL_LOCK();
+    settle();
+    size_t holes = myStrategy == Bitmap ? bitmap_holes() : stats.holes;
+    POOL_UNLOCK();
+    return holes;
+}
 
-    return count;
+int mem_holes(void)
+{
+    return saturate(mem_holes_count());
 }
 
 /* Get the number of bytes allocated */
-int mem_allocated(void)
+size_t mem_allocated_bytes(void)
 {
-    size_t size = 0;
-    for (memoryList *current = head; current; current = current->next)
-        if (current->alloc)
-            size += current->size;
+    POOL_LOCK();
+    settle();
+    size_t allocated = myStrategy == Bitmap ? bitmap_allocated() : stats.allocated_bytes;
+    POOL_UNLOCK();
+    return allocated;
+}
 
-    return size;
+int mem_allocated(void)
+{
+    return saturate(mem_allocated_bytes());
 }
 
 /* Number of non-allocated bytes */
+size_t mem_free_bytes(void)
+{
+    return mem_total_bytes() - mem_allocated_bytes();
+}
+
 int mem_free(void)
 {
-    return mem_total() - mem_allocated();
+    return saturate(mem_free_bytes());
 }
 
 /* Number of bytes in the largest contiguous area of unallocated memory */
+size_t mem_largest_free_bytes(void)
+{
+    POOL_LOCK();
+    settle();
+    size_t largest = largest_free_now();
+    POOL_UNLOCK();
+    return largest;
+}
+
 int mem_largest_free(void)
 {
-    size_t max = 0;
-    for (memoryList *current = head; current; current = current->next)
-        if (!current->alloc && current->size > max)
-            max = current->size;
+    return saturate(mem_largest_free_bytes());
+}
+
+/* The largest hole of either representation, for callers holding the pool lock */
+static size_t largest_free_now(void)
+{
+    if (myStrategy == Bitmap)
+        return bitmap_largest_free();
+    return largest_free_valid ? stats.largest_free : refresh_largest_free();
+}
 
+/* Rescan the holes after the cached largest one shrank or went away, only its bucket can hold it */
+static size_t refresh_largest_free(void)
+{
+    size_t max = 0;
+    int bucket = MEM_HOLE_BUCKETS - 1;
+    while (bucket > 0 && !hole_buckets[bucket])
+        bucket--;
+    for (memoryList *hole = hole_buckets[bucket]; hole; hole = hole->bnext)
+        if (hole->size > max)
+            max = hole->size;
+
+    stats.largest_free = max;
+    largest_free_valid = true;
     return max;
 }
 
 /* Number of free blocks smaller than or equal to "size" bytes. */
-int mem_small_free(int size)
+size_t mem_small_free_count(size_t size)
 {
-    int count = 0;
-    for (memoryList *current = head; current; current = current->next)
-        if (!current->alloc && current->size <= size)
-            count++;
+    POOL_LOCK();
+    settle();
+    size_t count = 0;
+    memoryList *current = free_head;
+    if (myStrategy == Bitmap)
+        count = bitmap_small_free(size);
+    else if (current)
+        do
+        {
+            if (current->size <= size)
+                count++;
+            current = current->fnext;
+        }
+        while (current != free_head);
+    POOL_UNLOCK();
 
     return count;
 }
 
+int mem_small_free(int size)
+{
+    return size < 0 ? 0 : saturate(mem_small_free_count(size));
+}
+
+/* '1' if ptr starts a block the caller holds, a block in the recycle cache is '0' */
 char mem_is_alloc(void *ptr)
 {
-    for(memoryList *current = head; current; current = current->next)
-        if (current->alloc && current->ptr == ptr)
-            return '1';
+    POOL_LOCK();
+    settle();
+    char found = '0';
+    if (myStrategy == Bitmap)
+        found = bitmap_is_alloc(ptr) ? '1' : '0';
+    else
+    {
+        memoryList *block = directory_lookup(ptr);
+        if (block && !block->cached)
+            found = '1';
+    }
+    POOL_UNLOCK();
+
+    return found;
+}
+
+/**
+ * Finds the block any address inside the pool falls in, for conservative scanners and debugging
+ * tools. With the block table on, see mem_set_block_table, this is a binary search, otherwise a
+ * walk of the memory list; a lookup never turns the table on, since keeping it costs every split
+ * and merge.
+ * Deferred frees are settled first, and blocks in the recycle cache count as free.
+ * @param ptr any address
+ * @param out set to the start and size of the block and whether it is allocated
+ * @return false if ptr is not inside the pool
+ */
+bool mem_block_of(void *ptr, mem_block_info *out)
+{
+    if (!myMemory || (char *) ptr < (char *) myMemory || (char *) ptr >= (char *) myMemory + mySize)
+        return false;
+
+    size_t offset = (char *) ptr - (char *) myMemory;
+    POOL_LOCK();
+    settle();
+    if (myStrategy == Bitmap)
+    {
+        size_t start;
+        bitmap_block_of(offset, &start, &out->size, &out->alloc);
+        out->start = (char *) myMemory + start;
+    }
+    else
+    {
+        memoryList *block = head;
+        if (use_block_table)
+            block = blocktable_containing(&table, offset);
+        else
+            while ((char *) ptr >= (char *) block->ptr + block->size)
+                block = block->next;
+
+        out->start = block->ptr;
+        out->size = block->size;
+        out->alloc = block->alloc && !block->cached;
+    }
+    POOL_UNLOCK();
+
+    return true;
+}
+
+/* Report the first broken invariant on stderr */
+static int check_failed(char *what)
+{
+    fprintf(stderr, "mem_check: %s\n", what);
+    return -1;
+}
+
+static int check_lists(void)
+{
+    size_t offset = 0, holes = 0, allocated = 0, blocks = 0;
+    memoryList *prev = NULL;
+
+    for (memoryList *current = head; current; prev = current, current = current->next)
+    {
+        if (current->prev != prev)
+            return check_failed("broken prev link");
+        if ((char *) current->ptr != (char *) myMemory + offset)
+            return check_failed("blocks are not contiguous");
+        if (!current->alloc && prev && !prev->alloc)
+            return check_failed("adjacent holes");
+        offset += current->size;
+        blocks++;
+        if (current->alloc)
+            allocated += current->size;
+        else
+            holes++;
+    }
+
+    if (offset != mySize)
+        return check_failed("blocks do not cover the pool");
+    if (blocks != stats.blocks || holes != stats.holes || allocated != stats.allocated_bytes)
+        return check_failed("counters out of date");
+
+    size_t listed = 0, largest = 0;
+    bool rover_seen = false, short_rover_seen = false;
+    memoryList *current = free_head;
+    if (current)
+        do
+        {
+            if (current->alloc)
+                return check_failed("allocated block on the free list");
+            if (current->fnext->fprev != current)
+                return check_failed("broken free list link");
+            if (current->fnext != free_head && current->fnext->ptr <= current->ptr)
+                return check_failed("free list not in address order");
+            rover_seen |= current == rover;
+            short_rover_seen |= current == short_rover;
+            if (current->size > largest)
+                largest = current->size;
+            listed++;
+            current = current->fnext;
+        }
+        while (current != free_head && listed <= holes);
+
+    if (listed != holes)
+        return check_failed("free list does not hold every hole");
+
+    listed = 0;
+    for (int bucket = 0; bucket < MEM_HOLE_BUCKETS; bucket++)
+        for (memoryList *hole = hole_buckets[bucket]; hole && listed <= holes; hole = hole->bnext, listed++)
+            if (hole->alloc || hole_bucket(hole->size) != bucket || (hole->bnext && hole->bnext->bprev != hole))
+                return check_failed("hole bucket lists out of date");
+    if (listed != holes)
+        return check_failed("hole bucket lists do not hold every hole");
+    if (holes && (!rover_seen || !short_rover_seen))
+        return check_failed("rover is not on the free list");
+    if (use_block_table && (blocktable_check(&table, head) || blocktable_largest_free(&table) != largest))
+        return check_failed("block table out of date");
+
+    return 0;
+}
+
+/**
+ * Walks the memory list and the free list and checks they agree with each other and with the
+ * counters. Meant for tests and debugging, it does not settle deferred frees first
+ * @return 0 when the pool is consistent, -1 after printing the first problem found
+ */
+int mem_check(void)
+{
+    POOL_LOCK();
+    int result;
+    if (myStrategy == Bitmap)
+        result = bitmap_check() ? check_failed("bitmap padding or block starts broken") : 0;
+    else
+        result = check_lists();
+    POOL_UNLOCK();
+    return result;
+}
+
+/**
+ * Snapshot of the fragmentation telemetry in one call. Everything is maintained incrementally,
+ * so this costs a copy of the counters plus, at worst, one walk to refresh the largest hole.
+ * @param out filled with the current counters, histogram and fragmentation index
+ */
+void mem_stats(mem_stats_t *out)
+{
+    POOL_LOCK();
+    settle();
+    largest_free_now();
+    *out = stats;
+    if (myStrategy == Bitmap)
+        bitmap_stats(out);
+    out->free_bytes = out->total_bytes - out->allocated_bytes;
+    out->fragmentation = out->free_bytes ? 1.0 - (double) out->largest_free / out->free_bytes : 0;
+    POOL_UNLOCK();
+}
+
+/**
+ * Steps through the blocks in address order for either the memory list or the bitmap. Start
+ * with *cursor at head and *offset and *size at 0
+ * @return false after the last block
+ */
+static bool next_block(memoryList **cursor, size_t *offset, size_t *size, bool *alloc)
+{
+    if (myStrategy == Bitmap)
+        return bitmap_block_at(*offset += *size, size, alloc);
+    if (!*cursor)
+        return false;
+
+    *offset = (char *) (*cursor)->ptr - (char *) myMemory;
+    *size = (*cursor)->size;
+    *alloc = (*cursor)->alloc;
+    *cursor = (*cursor)->next;
+    return true;
+}
+
+/* Write all of buffer to fd, retrying short writes and interrupts */
+static int write_fully(int fd, const unsigned char *buffer, size_t length)
+{
+    while (length)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int dump_blocks(int fd)
+{
+    unsigned char buffer[65536];
+    size_t used = MEMDUMP_HEADER_SIZE;
+    size_t expected = 0, offset = 0, size = 0;
+    memoryList *cursor = head;
+    mem_stats_t current;
+    bool alloc;
+
+    mem_stats(&current);
+    memcpy(buffer, MEMDUMP_MAGIC, 8);
+    memdump_put_u32(buffer + 8, MEMDUMP_VERSION);
+    memdump_put_u32(buffer + 12, myStrategy);
+    memdump_put_u64(buffer + 16, mySize);
+    memdump_put_u64(buffer + 24, current.blocks);
+    memdump_put_u64(buffer + 32, current.allocated_bytes);
+
+    while (next_block(&cursor, &offset, &size, &alloc))
+    {
+        if (used > sizeof(buffer) - 2 * MEMDUMP_MAX_VARINT)
+        {
+            if (write_fully(fd, buffer, used))
+                return -1;
+            used = 0;
+        }
+
+        used += memdump_put_varint(buffer + used, offset - expected);
+        used += memdump_put_varint(buffer + used, (uint64_t) size << 1 | alloc);
+        expected = offset + size;
+    }
+
+    return write_fully(fd, buffer, used);
+}
 
-    return '0';
+/**
+ * Stream a binary snapshot of the memory list to a file descriptor in one pass, see memdump.h
+ * for the format. Records are encoded into a stack buffer that is flushed with write(), so a
+ * million-block heap costs a few MB of output and a few dozen system calls.
+ * @param fd file descriptor opened for writing
+ * @return 0 on success, -1 if a write failed (errno is left set)
+ */
+int mem_dump(int fd)
+{
+    POOL_LOCK();
+    int result = dump_blocks(fd);
+    POOL_UNLOCK();
+    return result;
 }
 
 /*
@@ -400,11 +2630,16 @@ void *mem_pool(void)
 }
 
 // Returns the total number of bytes in the memory pool. */
-int mem_total(void)
+size_t mem_total_bytes(void)
 {
     return mySize;
 }
 
+int mem_total(void)
+{
+    return saturate(mem_total_bytes());
+}
+
 
 // Get string name for a strategy.
 char *strategy_name(strategies strategy)
@@ -419,6 +2654,8 @@ char *strategy_name(strategies strategy)
             return "first";
         case Next:
             return "next";
+        case Bitmap:
+            return "bitmap";
         default:
             return "unknown";
     }
@@ -443,6 +2680,10 @@ strategies strategyFromString(char * strategy)
     {
         return Next;
     }
+    else if (!strcmp(strategy,"bitmap"))
+    {
+        return Bitmap;
+    }
     else
     {
         return 0;
@@ -458,12 +2699,15 @@ strategies strategyFromString(char * strategy)
 /* Use this function to print out the current contents of memory. */
 void print_memory(void)
 {
-    memoryList *current = head;
-    while (current)
-    {
-        printf("Allocated: %s \tSize: %ld\tPtr: %p\n", current->alloc ? "true" : "false", current->size, current->ptr);
-        current = current->next;
-    }
+    memoryList *cursor = head;
+    size_t offset = 0, size = 0;
+    bool alloc;
+
+    POOL_LOCK();
+    settle();
+    while (next_block(&cursor, &offset, &size, &alloc))
+        printf("Allocated: %s \tSize: %ld\tPtr: %p\n", alloc ? "true" : "false", size, (char *) myMemory + offset);
+    POOL_UNLOCK();
 }
 
 /* Use this function to track memory allocation performance.
@@ -477,6 +2721,15 @@ void print_memory_status(void)
     printf("Average hole size is %lf.\n\n",((double)mem_free())/mem_holes());
 }
 
+/* Prints the mem_stats telemetry, kept apart so print_memory_status output stays as it was */
+void print_memory_stats(void)
+{
+    mem_stats_t current;
+    mem_stats(&current);
+    printf("External fragmentation is %.3f; %llu splits, %llu merges, %llu failed allocations.\n\n",
+           current.fragmentation, current.splits, current.merges, current.failed_allocations);
+}
+
 /* Use this function to see what happens when your malloc and free
  * implementations are called.  Run "mem -try <args>" to call this function.
  * We have given you a simple example to start.
@@ -1,4 +1,8 @@
+#ifndef MYMEM_H
+#define MYMEM_H
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -6,13 +10,18 @@
 #include <assert.h>
 #include <time.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum strategies_enum
 {
 	NotSet = 0,
 	Best = 1,
 	Worst = 2,
 	First = 3,
-	Next = 4
+	Next = 4,
+	Bitmap = 5      // granule bit array, not part of "all", see bitmap.h
 } strategies;
 
 typedef struct memoryList
@@ -23,28 +32,168 @@ typedef struct memoryList
 
     size_t size;
     bool alloc;
+    bool deferred;                  // freed, waiting on the deferred coalescing quick list
+    bool cached;                    // freed, held by the exact-size recycle cache
+    bool trimmed;                   // hole whose pages the maintenance thread gave back
 
     void *ptr;
+    struct memoryList *qnext;       // quick list or cache bin link
+
+    // address-ordered circular list of holes, only valid while !alloc
+    struct memoryList *fnext;
+    struct memoryList *fprev;
+
+    // holes in the same hole_histogram bucket, only valid while !alloc
+    struct memoryList *bnext;
+    struct memoryList *bprev;
 } memoryList;
 
+/* Number of hole-size histogram buckets; bucket i counts holes of [2^i, 2^(i+1)) bytes */
+#define MEM_HOLE_BUCKETS 48
+
+typedef struct mem_stats_t
+{
+    size_t total_bytes;
+    size_t allocated_bytes;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t holes;
+    size_t blocks;
+    double fragmentation;           // 1 - largest_free / free_bytes, 0 when nothing is free
+    unsigned long long splits;      // counted since the last initmem
+    unsigned long long merges;
+    unsigned long long failed_allocations;
+    unsigned long long deferred_reuses;     // allocations served from the deferred quick list
+    unsigned long long coalesce_batches;
+    unsigned long long cache_hits;          // exact-size recycle cache, see mem_cache_configure
+    unsigned long long cache_misses;
+    size_t cached_blocks;                   // counted as allocated until mem_cache_flush
+    size_t cached_bytes;
+    unsigned long long maintenance_passes;  // background thread, see mem_set_maintenance
+    unsigned long long background_frees;    // deferred frees coalesced by the background thread
+    size_t trimmed_bytes;                   // hole pages handed back to the kernel
+    size_t committed_bytes;                 // pool bytes made accessible, see mem_set_lazy_commit
+    size_t commit_high_water;               // end of the highest committed chunk
+    size_t hole_histogram[MEM_HOLE_BUCKETS];
+} mem_stats_t;
+
+/*
+ * Hot-path counters, only collected in builds with MYMEM_INSTRUMENT ("make instrumented").
+ * Search lengths go into log2 buckets: bucket i counts calls that visited [2^i, 2^(i+1)) nodes,
+ * bucket 0 also takes calls that visited none.
+ */
+#define MEM_INSTR_BUCKETS 32
+
+typedef struct mem_search_counter
+{
+    unsigned long long calls;
+    unsigned long long visited;
+    unsigned long long histogram[MEM_INSTR_BUCKETS];
+} mem_search_counter;
+
+typedef struct mem_instr_t
+{
+    mem_search_counter search[5];   // indexed by strategy, NotSet is unused
+    mem_search_counter find_block;
+    unsigned long long splits;
+    unsigned long long merge_left_calls;
+    unsigned long long early_rejections;
+} mem_instr_t;
+
+/* The block an address falls in, see mem_block_of */
+typedef struct mem_block_info
+{
+    void *start;
+    size_t size;
+    bool alloc;
+} mem_block_info;
+
+/* Value mem_prof_dump reports for every allocation site */
+typedef enum mem_prof_kind
+{
+    ProfInuseBytes = 0,     // estimated bytes allocated and not yet freed
+    ProfAllocBytes = 1,     // estimated bytes allocated since mem_prof_enable
+    ProfLifetime = 2        // mean lifetime of the sampled blocks freed so far, in microseconds
+} mem_prof_kind;
+
+/* Slot index and generation of a block allocated with mymalloc_handle, 0 is never valid */
+typedef uint64_t mem_handle;
+
+/* How long a block is expected to live, see mymalloc_hint */
+typedef enum mem_lifetime
+{
+    LifetimeUnknown = 0,    // placed like mymalloc places it
+    LifetimeShort = 1,      // placed from the high end of the pool
+    LifetimeLong = 2        // placed from the low end of the pool
+} mem_lifetime;
+
 char *strategy_name(strategies);
 strategies strategyFromString(char *);
 
 
 void initmem(strategies, size_t);
 void *mymalloc(size_t);
+void *mymalloc_first(size_t);
+void *mymalloc_best(size_t);
+void *mymalloc_worst(size_t);
+void *mymalloc_next(size_t);
+void *mymalloc_wait(size_t, int);
+size_t mem_waiting_count(void);
+void *mymalloc_hint(size_t, mem_lifetime);
+void mem_set_lifetime_prediction(size_t);
+void mem_set_line_colouring(size_t, unsigned);
 void myfree(void *);
+void myfree_sized(void *, size_t);
+size_t mem_usable_size(void *);
+mem_handle mymalloc_handle(size_t);
+void *mem_handle_get(mem_handle);
+bool myfree_handle(mem_handle);
+void mem_set_deferred_coalescing(size_t);
+void mem_coalesce(void);
+size_t mem_parked_count(void);
+void mem_cache_configure(size_t, size_t);
+void mem_cache_flush(void);
+void mem_set_block_table(bool);
+void mem_set_maintenance(unsigned);
+void mem_set_shared(bool);
+void mem_set_lazy_commit(bool);
+/* Until mem_stack_end every mymalloc, coloured and hinted ones too, is a max_align_t aligned bump */
+bool mem_stack_begin(size_t);
+void mem_stack_end(void);
+size_t mem_mark(void);
+void mem_release(size_t);
 
-int mem_holes(void);
+/*
+ * Blocks in the recycle cache are still taken from the pool's point of view and free from the
+ * caller's: the byte and hole counts below include them as allocated, while mem_is_alloc and
+ * mem_block_of report them as free. mem_stats gives cached_bytes to convert between the two.
+ */
+size_t mem_holes_count(void);
+size_t mem_allocated_bytes(void);
+size_t mem_free_bytes(void);
+size_t mem_total_bytes(void);
+size_t mem_largest_free_bytes(void);
+size_t mem_small_free_count(size_t);
+int mem_holes(void);            // the int versions saturate at INT_MAX
 int mem_allocated(void);
 int mem_free(void);
 int mem_total(void);
 int mem_largest_free(void);
 int mem_small_free(int);
 char mem_is_alloc(void *);
+bool mem_block_of(void *, mem_block_info *);
+int mem_check(void);
+void mem_stats(mem_stats_t *);
+int mem_dump(int);
+int mem_instr_read(mem_instr_t *);
+void mem_instr_reset(void);
 void *mem_pool(void);
 void print_memory(void);
 void print_memory_status(void);
+void print_memory_stats(void);
+void print_memory_instrumentation(void);
+void mem_prof_enable(size_t);
+int mem_prof_dump(int, mem_prof_kind);
 void try_mymem(int, char **);
 
 void *allocate_block_of_memory(memoryList *, size_t);
@@ -54,3 +203,9 @@ memoryList *firstfit(size_t);
 memoryList *worstfit(size_t);
 memoryList *bestfit(size_t);
 memoryList *nextfit(size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef MYMEM_ALLOCATOR_HPP
+#define MYMEM_ALLOCATOR_HPP
+
+/*
+ * C++ adaptors over the pool managed by mymem.c, header-only:
+ *
+ *   mymem_allocator<T>   a stateless allocator for std containers,
+ *                        e.g. std::vector<int, mymem_allocator<int>>
+ *   mymem_resource       a std::pmr::memory_resource for std::pmr containers,
+ *                        see mymem_default_resource()
+ *
+ * Both draw from whatever pool the last initmem set up, so every instance compares equal and
+ * containers can swap and move storage freely. Like mymem.c itself they are not thread-safe,
+ * and the pool must outlive the containers using it.
+ *
+ * mymalloc returns blocks at any byte offset, so alignment is done here: the block is over-
+ * allocated by the alignment, the returned pointer is rounded up past at least one byte, and
+ * the distance back to the real block is stored just below it (one byte for alignments up to
+ * 256, a size_t above that). Deallocation is told the size and alignment again, reads the
+ * distance back and hands the pool the exact size it allocated through myfree_sized.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "mymem.h"
+
+namespace mymem
+{
+    constexpr std::size_t small_align_limit = 256;
+
+    inline void *allocate(std::size_t bytes, std::size_t alignment)
+    {
+        std::size_t header = alignment <= small_align_limit ? 1 : sizeof(std::size_t);
+        if (bytes > std::numeric_limits<std::size_t>::max() - alignment - header)
+            throw std::bad_alloc();
+
+        unsigned char *raw = static_cast<unsigned char *>(mymalloc(bytes + alignment - 1 + header));
+        if (!raw)
+            throw std::bad_alloc();
+
+        std::uintptr_t first = reinterpret_cast<std::uintptr_t>(raw) + header;
+        unsigned char *aligned = reinterpret_cast<unsigned char *>((first + alignment - 1) & ~(alignment - 1));
+        std::size_t adjust = aligned - raw;
+
+        if (header == 1)
+            aligned[-1] = static_cast<unsigned char>(adjust);     // 256 wraps to 0
+        else
+            reinterpret_cast<std::size_t *>(aligned)[-1] = adjust;
+        return aligned;
+    }
+
+    inline void deallocate(void *ptr, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        unsigned char *aligned = static_cast<unsigned char *>(ptr);
+        std::size_t header = alignment <= small_align_limit ? 1 : sizeof(std::size_t);
+        std::size_t adjust;
+
+        if (alignment <= small_align_limit)
+            adjust = aligned[-1] ? aligned[-1] : small_align_limit;
+        else
+            adjust = reinterpret_cast<std::size_t *>(aligned)[-1];
+        myfree_sized(aligned - adjust, bytes + alignment - 1 + header);
+    }
+}
+
+template <class T>
+struct mymem_allocator
+{
+    typedef T value_type;
+
+    mymem_allocator() noexcept = default;
+    template <class U>
+    mymem_allocator(const mymem_allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+            throw std::bad_array_new_length();
+        return static_cast<T *>(mymem::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        mymem::deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const mymem_allocator<T> &, const mymem_allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const mymem_allocator<T> &, const mymem_allocator<U> &) noexcept
+{
+    return false;
+}
+
+class mymem_resource : public std::pmr::memory_resource
+{
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return mymem::allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override
+    {
+        mymem::deallocate(ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return dynamic_cast<const mymem_resource *>(&other) != nullptr;
+    }
+};
+
+/* One shared resource, for std::pmr::set_default_resource or container constructors */
+inline mymem_resource *mymem_default_resource() noexcept
+{
+    static mymem_resource resource;
+    return &resource;
+}
+
+#endif
@@ -5,6 +5,9 @@ Original Author: L. Angrave
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include <stdio.h>
 #include <signal.h>
@@ -27,6 +30,7 @@ Original Author: L. Angrave
 /* defaults */
 static int default_timeout_seconds=5;
 static int timeout_seconds;
+static int worker_jobs=0; /* 0 == one worker per online CPU */
 
 void set_testrunner_default_timeout(int s) {
 	assert(s>0);
@@ -38,6 +42,18 @@ void set_testrunner_timeout(int s) {
 	timeout_seconds=s;
 }
 
+void set_testrunner_jobs(int n) {
+	assert(n>=0);
+	worker_jobs=n;
+}
+
+int testrunner_jobs(void) {
+	long cpus;
+	if(worker_jobs>0) return worker_jobs;
+	cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus>0 ? (int)cpus : 1;
+}
+
 /*  --- Helper macros and functions  --- */
 #define DIE(mesg) {fprintf(stderr,"\n%s(%d):%s\n",__fname__,__LINE__,mesg); exit(1);}
 static int eql( char*s1, char*s2) {return s1&&s2&&!strcmp(s1,s2);}
@@ -134,6 +150,103 @@ static int invoke_test_with_timelimit(testentry_t* test, int redirect_stdouterr,
 }
 
 
+/*
+ * Run job_function(job, result) for every job in [0, job_count) in a pool of forked worker
+ * processes, at most testrunner_jobs() at a time. Each worker sends its result_size bytes back
+ * over a pipe and they are stored at results + job * result_size, so the caller sees them in
+ * job order no matter in which order the workers finish. job_status[job] is 0 for a job that
+ * completed, otherwise the wait status of the worker (its result is left zeroed).
+ * Workers are killed if the process running the pool dies, e.g. from the test timeout.
+ * The parent only reads a result after waitpid, so result_size must fit in the pipe buffer
+ * (64KiB on Linux, as little as 4KiB elsewhere) or the worker blocks on its write forever.
+ * Returns the number of jobs that did not complete.
+ */
+int run_parallel_jobs(job_fp job_function, int job_count, void *results, size_t result_size, int *job_status)
+{
+	int workers=testrunner_jobs();
+	pid_t *pids=calloc(job_count,sizeof(pid_t));
+	int *pipes=calloc(job_count,sizeof(int));
+	int next_job=0, running=0, failed=0, job;
+
+	assert(job_function && results && job_status && job_count>=0);
+	memset(results,0,job_count*result_size);
+
+	while(next_job<job_count || running>0) {
+		int wait_status;
+		pid_t pid;
+
+		while(running<workers && next_job<job_count) {
+			int fds[2];
+			job=next_job++;
+
+			if(pipe(fds)==-1 || (pids[job]=fork())==-1) {
+				/* out of processes or descriptors, so run this one inline */
+				if(pids[job]==-1) {
+					close(fds[0]);
+					close(fds[1]);
+				}
+				job_function(job,(char*)results+job*result_size);
+				job_status[job]=0;
+				pids[job]=0;
+				continue;
+			}
+
+			if(pids[job]==0) {
+				void *result=calloc(1,result_size);
+				size_t written=0;
+#ifdef __linux__
+				prctl(PR_SET_PDEATHSIG,SIGKILL);
+#endif
+				close(fds[0]);
+				job_function(job,result);
+				while(written<result_size) {
+					ssize_t n=write(fds[1],(char*)result+written,result_size-written);
+					if(n<=0) _exit(1);
+					written+=n;
+				}
+				_exit(0);
+			}
+
+			close(fds[1]);
+			pipes[job]=fds[0];
+			running++;
+		}
+
+		if(running==0) continue;
+
+		pid=waitpid(-1,&wait_status,0);
+		if(pid==-1) {
+			if(errno==EINTR) continue;
+			break;
+		}
+
+		for(job=0;job<job_count && pids[job]!=pid;job++);
+		if(job==job_count) continue;
+		running--;
+		pids[job]=0;
+
+		if(WIFEXITED(wait_status) && WEXITSTATUS(wait_status)==0) {
+			size_t got=0;
+			ssize_t n;
+			while(got<result_size && (n=read(pipes[job],(char*)results+job*result_size+got,result_size-got))>0)
+				got+=n;
+			job_status[job]= got==result_size ? 0 : -1;
+		} else
+			job_status[job]= wait_status ? wait_status : -1;
+
+		if(job_status[job]) {
+			memset((char*)results+job*result_size,0,result_size);
+			failed++;
+		}
+		close(pipes[job]);
+	}
+
+	free(pids);
+	free(pipes);
+	return failed;
+}
+
+
   /*
    * run a test and update the stats. The main guts of this functionality is provided by invoke_test_with_timelimit
    * This outer wrapper updates thes output and statistics before and after running the test.
@@ -224,6 +337,8 @@ run_testrunner(int argc, char **argv,testentry_t tests[],int test_count)
 		max_errors_before_quit=atoi(target+1);
 	else if(target[1]=='r')
 		redirect_stdouterr=1;
+	else if(target[1]=='j' && target[2])
+		set_testrunner_jobs(atoi(target+2));
 	}
 
 	target_matched = false;
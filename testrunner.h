@@ -20,3 +20,9 @@ int run_testrunner(int argc, char **argv, testentry_t *entries,int entry_count);
 void set_testrunner_default_timeout(int s);
 void set_testrunner_timeout(int s);
 
+typedef void (*job_fp) (int, void *);
+
+void set_testrunner_jobs(int n);
+int testrunner_jobs(void);
+int run_parallel_jobs(job_fp job_function, int job_count, void *results, size_t result_size, int *job_status);
+
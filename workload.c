@@ -0,0 +1,304 @@
+#include <limits.h>
+#include <math.h>
+
+#include "mymem.h"
+#include "workload.h"
+
+/****** PRNG ******/
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(rng_t *rng, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_next(rng_t *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Uniform integer in [0, bound) without modulo bias (Lemire's multiply-shift) */
+uint64_t rng_below(rng_t *rng, uint64_t bound)
+{
+    unsigned __int128 m = (unsigned __int128) rng_next(rng) * bound;
+    uint64_t low = (uint64_t) m;
+
+    if (low < bound)
+    {
+        uint64_t threshold = -bound % bound;
+        while (low < threshold)
+        {
+            m = (unsigned __int128) rng_next(rng) * bound;
+            low = (uint64_t) m;
+        }
+    }
+
+    return (uint64_t) (m >> 64);
+}
+
+/* Uniform double in [0, 1) */
+double rng_double(rng_t *rng)
+{
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+/****** Size generators ******/
+
+size_t size_uniform(const size_dist *dist, rng_t *rng)
+{
+    return dist->min + rng_below(rng, dist->max - dist->min + 1);
+}
+
+/**
+ * Bounded Pareto sizes between min and max: most requests are close to min with a heavy
+ * tail towards max. Larger alpha makes the tail thinner.
+ */
+size_t size_power_law(const size_dist *dist, rng_t *rng)
+{
+    double low = pow((double) dist->min, dist->alpha);
+    double high = pow((double) dist->max, dist->alpha);
+    double u = rng_double(rng);
+    double x = pow(-(u * high - u * low - high) / (high * low), -1.0 / dist->alpha);
+
+    size_t size = (size_t) x;
+    if (size < dist->min)
+        return dist->min;
+    if (size > dist->max)
+        return dist->max;
+    return size;
+}
+
+/* Uniform within one of two size modes, picking the small one with probability small_fraction */
+size_t size_bimodal(const size_dist *dist, rng_t *rng)
+{
+    if (rng_double(rng) < dist->small_fraction)
+        return dist->min + rng_below(rng, dist->small_max - dist->min + 1);
+
+    return dist->large_min + rng_below(rng, dist->max - dist->large_min + 1);
+}
+
+/****** Lifetime generators ******/
+
+/* Exponential lifetimes drawn from the short-lived or the long-lived population */
+long lifetime_exponential_mix(const lifetime_dist *dist, rng_t *rng)
+{
+    double mean = rng_double(rng) < dist->short_fraction ? dist->short_mean : dist->long_mean;
+    return 1 + (long) (-mean * log(1.0 - rng_double(rng)));
+}
+
+/****** Driver ******/
+
+typedef struct
+{
+    void *ptr;
+    long death;
+} live_object;
+
+/*
+ * The live set is a binary min-heap on the time of death, grown on demand. Objects without a
+ * lifetime die at LONG_MAX, so the heap also serves random removal for those.
+ */
+typedef struct
+{
+    live_object *objects;
+    size_t count;
+    size_t capacity;
+} live_set;
+
+static void live_swap(live_set *set, size_t a, size_t b)
+{
+    live_object tmp = set->objects[a];
+    set->objects[a] = set->objects[b];
+    set->objects[b] = tmp;
+}
+
+static void live_sift_up(live_set *set, size_t i)
+{
+    while (i > 0 && set->objects[(i - 1) / 2].death > set->objects[i].death)
+    {
+        live_swap(set, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void live_sift_down(live_set *set, size_t i)
+{
+    for (;;)
+    {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < set->count && set->objects[left].death < set->objects[smallest].death)
+            smallest = left;
+        if (right < set->count && set->objects[right].death < set->objects[smallest].death)
+            smallest = right;
+        if (smallest == i)
+            return;
+
+        live_swap(set, i, smallest);
+        i = smallest;
+    }
+}
+
+static void live_push(live_set *set, void *ptr, long death)
+{
+    if (set->count == set->capacity)
+    {
+        set->capacity = set->capacity ? set->capacity * 2 : 1024;
+        set->objects = realloc(set->objects, set->capacity * sizeof(live_object));
+    }
+
+    set->objects[set->count].ptr = ptr;
+    set->objects[set->count].death = death;
+    live_sift_up(set, set->count++);
+}
+
+/* Remove the object at index i and return its pointer */
+static void *live_remove(live_set *set, size_t i)
+{
+    void *ptr = set->objects[i].ptr;
+
+    set->objects[i] = set->objects[--set->count];
+    if (i < set->count)
+    {
+        live_sift_up(set, i);
+        live_sift_down(set, i);
+    }
+
+    return ptr;
+}
+
+/* Short-lived below the geometric mean of the two lifetime modes, unknown without lifetimes */
+static mem_lifetime lifetime_class(const lifetime_dist *lifetimes, long lifetime)
+{
+    if (lifetime < 0)
+        return LifetimeUnknown;
+    return lifetime < sqrt(lifetimes->short_mean * lifetimes->long_mean) ? LifetimeShort : LifetimeLong;
+}
+
+long workload_iterations(const workload *load)
+{
+    long total = 0;
+    for (int i = 0; i < load->phase_count; i++)
+        total += load->phases[i].iterations;
+
+    return total;
+}
+
+/**
+ * Runs a workload against one strategy and accumulates the same statistics as the original
+ * randomized test. Every iteration first frees the objects whose lifetime ended, then allocates
+ * a new block while less than the phase's current fill ratio of the pool is in use. Otherwise,
+ * or right after a failed allocation, one block is freed: the one closest to its death when the
+ * phase has lifetimes, a random one when it does not.
+ * @param strategy strategy passed to initmem
+ * @param pool_size size of the pool passed to initmem
+ * @param load phases to run, in order
+ * @param small_block_size threshold handed to mem_small_free
+ * @param result filled with the accumulated statistics
+ */
+void run_workload(int strategy, size_t pool_size, const workload *load, size_t small_block_size,
+                  workload_result *result)
+{
+    live_set live = {NULL, 0, 0};
+    rng_t rng;
+    struct timespec execstart, execend;
+    int force_free = 0;
+    long now = 0;
+
+    memset(result, 0, sizeof(*result));
+    rng_seed(&rng, load->seed);
+    initmem(strategy, pool_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &execstart);
+
+    for (int p = 0; p < load->phase_count; p++)
+    {
+        const workload_phase *phase = &load->phases[p];
+
+        for (long i = 0; i < phase->iterations; i++, now++)
+        {
+            float fill = phase->fill_start + (phase->fill_end - phase->fill_start) * i / phase->iterations;
+
+            while (live.count && live.objects[0].death <= now)
+                myfree(live_remove(&live, 0));
+
+            if (!force_free && mem_free_bytes() > pool_size * (1 - fill))
+            {
+                size_t size = phase->sizes.generate(&phase->sizes, &rng);
+                long lifetime = phase->lifetimes.generate ? phase->lifetimes.generate(&phase->lifetimes, &rng) : -1;
+                void *pointer = load->lifetime_hints ? mymalloc_hint(size, lifetime_class(&phase->lifetimes, lifetime)) : mymalloc(size);
+
+                if (pointer)
+                {
+                    live_push(&live, pointer, lifetime < 0 ? LONG_MAX : now + lifetime);
+                    if (live.count > result->peak_live_blocks)
+                        result->peak_live_blocks = live.count;
+                }
+                else
+                {
+                    result->failed_allocations++;
+                    force_free = 1;
+                }
+            }
+            else
+            {
+                force_free = 0;
+                if (live.count)
+                    myfree(live_remove(&live, phase->lifetimes.generate ? 0 : rng_below(&rng, live.count)));
+            }
+
+            size_t holes = mem_holes_count();
+            result->sum_largest_free += mem_largest_free_bytes();
+            result->sum_hole_size += holes ? mem_free_bytes() / holes : 0;
+            result->sum_allocated += mem_allocated_bytes();
+            result->sum_small += mem_small_free_count(small_block_size);
+            result->iterations++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &execend);
+    result->elapsed_ms = (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0;
+
+    free(live.objects);
+}
+
+/* Append one strategy's results in the tests.log format */
+void log_workload_result(FILE *log, int strategy, const workload_result *result)
+{
+    long iterations = result->iterations ? result->iterations : 1;
+
+    fprintf(log, "\t=== %s ===\n", strategy_name(strategy));
+    fprintf(log, "\tTest took %.2fms.\n", result->elapsed_ms);
+    fprintf(log, "\tAverage hole size: %f\n", result->sum_hole_size / iterations);
+    fprintf(log, "\tAverage largest free block: %f\n", result->sum_largest_free / iterations);
+    fprintf(log, "\tAverage allocated bytes: %f\n", result->sum_allocated / iterations);
+    fprintf(log, "\tAverage number of small blocks: %f\n", result->sum_small / iterations);
+    fprintf(log, "\tFailed allocations: %d\n", result->failed_allocations);
+    fprintf(log, "\tPeak live blocks: %zu\n", result->peak_live_blocks);
+}
@@ -0,0 +1,94 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* xoshiro256** seeded through splitmix64, fast and reproducible across platforms */
+typedef struct
+{
+    uint64_t s[4];
+} rng_t;
+
+void rng_seed(rng_t *, uint64_t);
+uint64_t rng_next(rng_t *);
+uint64_t rng_below(rng_t *, uint64_t);
+double rng_double(rng_t *);
+
+/*
+ * Size generators. Each distribution carries the generator function that samples it, so a
+ * workload can plug in its own function next to the ready-made ones below.
+ */
+typedef struct size_dist size_dist;
+typedef size_t (*size_generator)(const size_dist *, rng_t *);
+
+struct size_dist
+{
+    size_generator generate;
+    size_t min, max;          // inclusive bounds for every generator
+    double alpha;             // power law exponent
+    size_t small_max;         // bimodal: small mode is [min, small_max]
+    size_t large_min;         // bimodal: large mode is [large_min, max]
+    double small_fraction;    // bimodal: probability of the small mode
+};
+
+size_t size_uniform(const size_dist *, rng_t *);
+size_t size_power_law(const size_dist *, rng_t *);
+size_t size_bimodal(const size_dist *, rng_t *);
+
+/*
+ * Lifetime generators return the number of iterations an object stays live. A NULL
+ * generator means objects have no lifetime and a random live block is freed under pressure,
+ * which is what the original randomized test did.
+ */
+typedef struct lifetime_dist lifetime_dist;
+typedef long (*lifetime_generator)(const lifetime_dist *, rng_t *);
+
+struct lifetime_dist
+{
+    lifetime_generator generate;
+    double short_fraction;    // probability an object is short-lived
+    double short_mean;        // mean lifetime of short-lived objects in iterations
+    double long_mean;         // mean lifetime of long-lived objects in iterations
+};
+
+long lifetime_exponential_mix(const lifetime_dist *, rng_t *);
+
+/* One phase of a workload; the target fill ratio ramps linearly from fill_start to fill_end */
+typedef struct
+{
+    long iterations;
+    float fill_start, fill_end;
+    size_dist sizes;
+    lifetime_dist lifetimes;
+} workload_phase;
+
+#define WORKLOAD_MAX_PHASES 8
+
+typedef struct
+{
+    char *name;
+    uint64_t seed;
+    int lifetime_hints;       // pass every object's lifetime class to mymalloc_hint
+    int phase_count;
+    workload_phase phases[WORKLOAD_MAX_PHASES];
+} workload;
+
+/* What the stress suite reports for one strategy */
+typedef struct
+{
+    long iterations;
+    double elapsed_ms;
+    double sum_hole_size;
+    double sum_largest_free;
+    double sum_allocated;
+    double sum_small;
+    int failed_allocations;
+    size_t peak_live_blocks;
+} workload_result;
+
+long workload_iterations(const workload *);
+void run_workload(int, size_t, const workload *, size_t, workload_result *);
+void log_workload_result(FILE *, int, const workload_result *);
+
+#endif